@@ -0,0 +1,697 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+
+#ifdef AOT
+#include <dlfcn.h>
+
+// The VM functions native code calls for anything but numbers. Each
+// is passed the stack top and works on the values below it, so they
+// are where the collector can find them. The generated C declares the
+// same struct, written by writePrelude(), so the two must be changed
+// together.
+typedef struct AotRuntime {
+  // Concatenates the top two values and returns true if they are
+  // strings.
+  bool (*add)(Value* stackTop);
+  // The same for the top count values.
+  bool (*concatenate)(Value* stackTop, int count);
+  // Whether the top two values are equal.
+  bool (*equal)(Value* stackTop);
+  // Prints the top value.
+  void (*print)(Value* stackTop);
+} AotRuntime;
+
+static bool runtimeAdd(Value* stackTop) {
+  if (!IS_ANY_STRING(stackTop[-1]) || !IS_ANY_STRING(stackTop[-2])) {
+    return false;
+  }
+  vm.stackTop = stackTop;
+  concatenate();
+  return true;
+}
+
+static bool runtimeConcatenate(Value* stackTop, int count) {
+  for (int i = 1; i <= count; i++) {
+    if (!IS_ANY_STRING(stackTop[-i])) return false;
+  }
+  vm.stackTop = stackTop;
+  concatenateN(count);
+  return true;
+}
+
+static bool runtimeEqual(Value* stackTop) {
+  vm.stackTop = stackTop;
+  return valuesEqual(stackTop[-2], stackTop[-1]);
+}
+
+static void runtimePrint(Value* stackTop) {
+  vm.stackTop = stackTop;
+  printValue(stackTop[-1]);
+  printf("\n");
+}
+
+static const AotRuntime runtime = {
+  runtimeAdd,
+  runtimeConcatenate,
+  runtimeEqual,
+  runtimePrint,
+};
+
+typedef struct {
+  ObjFunction** functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+// Lists script and every function declared in it, depth first in the
+// order of their constants. Compiling the same source always gives the
+// same list, which is how native code is matched up with its function.
+static void listFunctions(FunctionList* list, ObjFunction* function) {
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->functions = GROW_ARRAY(ObjFunction*, list->functions,
+                                 oldCapacity, list->capacity);
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      listFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+// FNV-1a over the bytecode of every function, so that a shared object
+// isn't run by an mti that compiles its source differently.
+static uint32_t checksum(FunctionList* list) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < list->count; i++) {
+    Chunk* chunk = &list->functions[i]->chunk;
+    for (int offset = 0; offset < chunk->count; offset++) {
+      hash ^= chunk->code[offset];
+      hash *= 16777619;
+    }
+    hash ^= (uint32_t)chunk->constants.count;
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static int readLong(uint8_t* operand) {
+  return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+static void writePrelude(FILE* out) {
+  fprintf(out,
+      "#include <stdbool.h>\n"
+      "#include <stdint.h>\n"
+      "\n"
+      "typedef uint64_t Value;\n"
+      "\n"
+      "typedef struct AotRuntime {\n"
+      "  bool (*add)(Value* stackTop);\n"
+      "  bool (*concatenate)(Value* stackTop, int count);\n"
+      "  bool (*equal)(Value* stackTop);\n"
+      "  void (*print)(Value* stackTop);\n"
+      "} AotRuntime;\n"
+      "\n"
+      "typedef int (*AotFunction)(const AotRuntime* runtime,\n"
+      "                           Value* constants, Value* globals,\n"
+      "                           Value* slots, Value** stackTop,\n"
+      "                           int offset);\n"
+      "\n"
+      "#define QNAN 0x%016llxull\n"
+      "#define NIL_VAL 0x%016llxull\n"
+      "#define FALSE_VAL 0x%016llxull\n"
+      "#define TRUE_VAL 0x%016llxull\n"
+      "#define UNDEFINED_VAL 0x%016llxull\n"
+      "\n"
+      "#define IS_NUMBER(value) (((value) & QNAN) != QNAN)\n"
+      "#define IS_FALSEY(value) ((value) == NIL_VAL || (value) == FALSE_VAL)\n"
+      "#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)\n"
+      "\n"
+      "static inline double num(Value value) {\n"
+      "  union { Value value; double number; } cast = { value };\n"
+      "  return cast.number;\n"
+      "}\n"
+      "\n"
+      "static inline Value val(double number) {\n"
+      "  union { double number; Value value; } cast = { number };\n"
+      "  return cast.value;\n"
+      "}\n",
+      (unsigned long long)QNAN, (unsigned long long)NIL_VAL,
+      (unsigned long long)FALSE_VAL, (unsigned long long)TRUE_VAL,
+      (unsigned long long)UNDEFINED_VAL);
+}
+
+// Writes C for one function at a time. The stack is kept in variables,
+// sN for slot N, which the C compiler can keep in registers. They are
+// only written to the frame's slots when the function leaves to the
+// interpreter or calls the runtime.
+typedef struct {
+  FILE* out;
+  Chunk* chunk;
+  // The instruction being written.
+  int offset;
+  // The values on the stack before it.
+  int depth;
+  // The depths some instruction leaves to the interpreter at.
+  bool* exits;
+} Writer;
+
+// Formats an expression for a constant into buffer. Objects are read
+// from the function's constants, since they are only created when the
+// script is compiled again at load time.
+static const char* constantExpression(char* buffer, size_t size,
+                                      Chunk* chunk, int index) {
+  Value value = chunk->constants.values[index];
+  if (IS_OBJ(value)) {
+    snprintf(buffer, size, "constants[%d]", index);
+  } else {
+    snprintf(buffer, size, "0x%016llxull", (unsigned long long)value);
+  }
+  return buffer;
+}
+
+static void writeFlush(Writer* writer, int count) {
+  for (int i = 0; i < count; i++) {
+    fprintf(writer->out, "  slots[%d] = s%d;\n", i, i);
+  }
+}
+
+// The runtime can move young objects, so every value is read back.
+static void writeReload(Writer* writer, int count) {
+  for (int i = 0; i < count; i++) {
+    fprintf(writer->out, "  s%d = slots[%d];\n", i, i);
+  }
+}
+
+// Leaves to the interpreter at the instruction, with depth values on
+// the stack.
+static void writeExit(Writer* writer, int depth) {
+  writer->exits[depth] = true;
+  fprintf(writer->out, "{ resume = %d; goto exit%d; }", writer->offset,
+          depth);
+}
+
+// Leaves to the interpreter at the instruction unless the values are
+// numbers.
+static void writeNumberCheck(Writer* writer, int a, int b) {
+  fprintf(writer->out, "  if (!IS_NUMBER(s%d) || !IS_NUMBER(s%d)) ", a, b);
+  writeExit(writer, writer->depth);
+  fprintf(writer->out, "\n");
+}
+
+// Unchecked instructions leave out the number check.
+static void writeArithmetic(Writer* writer, const char* op,
+                            bool checked) {
+  int a = writer->depth - 2;
+  int b = writer->depth - 1;
+  if (checked) writeNumberCheck(writer, a, b);
+  fprintf(writer->out, "  s%d = val(num(s%d) %s num(s%d));\n", a, a, op,
+          b);
+}
+
+static void writeComparison(Writer* writer, const char* format,
+                            bool checked) {
+  int a = writer->depth - 2;
+  int b = writer->depth - 1;
+  if (checked) writeNumberCheck(writer, a, b);
+  fprintf(writer->out, "  s%d = BOOL_VAL(", a);
+  fprintf(writer->out, format, a, b);
+  fprintf(writer->out, ");\n");
+}
+
+// Strings are added by the runtime, with a and b on top of the stack.
+static void writeAdd(Writer* writer, const char* a, const char* b,
+                     int result) {
+  FILE* out = writer->out;
+  fprintf(out, "  if (IS_NUMBER(%s) && IS_NUMBER(%s)) {\n"
+               "  s%d = val(num(%s) + num(%s));\n"
+               "  } else {\n", a, b, result, a, b);
+  writeFlush(writer, result);
+  fprintf(out, "  slots[%d] = %s;\n  slots[%d] = %s;\n", result, a,
+          result + 1, b);
+  fprintf(out, "  if (!runtime->add(slots + %d)) ", result + 2);
+  writeExit(writer, writer->depth);
+  fprintf(out, "\n");
+  writeReload(writer, result + 1);
+  fprintf(out, "  }\n");
+}
+
+static void writeEquality(Writer* writer, bool equal) {
+  FILE* out = writer->out;
+  int a = writer->depth - 2;
+  int b = writer->depth - 1;
+  fprintf(out, "  if (IS_NUMBER(s%d) && IS_NUMBER(s%d)) {\n"
+               "  s%d = BOOL_VAL(num(s%d) %s num(s%d));\n"
+               "  } else {\n",
+          a, b, a, a, equal ? "==" : "!=", b);
+  writeFlush(writer, writer->depth);
+  fprintf(out, "  bool equal = runtime->equal(slots + %d);\n",
+          writer->depth);
+  writeReload(writer, a);
+  fprintf(out, "  s%d = BOOL_VAL(%sequal);\n  }\n", a, equal ? "" : "!");
+}
+
+static void writeGlobal(Writer* writer, uint8_t instruction, int slot) {
+  FILE* out = writer->out;
+  int top = writer->depth - 1;
+  switch (instruction) {
+    case OpDefineGlobal:
+    case OpDefineGlobalLong:
+      fprintf(out, "  globals[%d] = s%d;\n", slot, top);
+      return;
+    case OpGetGlobal:
+    case OpGetGlobalLong:
+      fprintf(out, "  if (globals[%d] == UNDEFINED_VAL) ", slot);
+      writeExit(writer, writer->depth);
+      fprintf(out, "\n  s%d = globals[%d];\n", top + 1, slot);
+      return;
+    default:
+      fprintf(out, "  if (globals[%d] == UNDEFINED_VAL) ", slot);
+      writeExit(writer, writer->depth);
+      fprintf(out, "\n  globals[%d] = s%d;\n", slot, top);
+      return;
+  }
+}
+
+static void writeConcatenation(Writer* writer, int count) {
+  FILE* out = writer->out;
+  int first = writer->depth - count;
+  fprintf(out, "  if (");
+  for (int i = first; i < writer->depth; i++) {
+    fprintf(out, "%sIS_NUMBER(s%d)", i > first ? " && " : "", i);
+  }
+  fprintf(out, ") {\n  s%d = val(", first);
+  for (int i = first; i < writer->depth; i++) {
+    fprintf(out, "%snum(s%d)", i > first ? " + " : "", i);
+  }
+  fprintf(out, ");\n  } else {\n");
+  writeFlush(writer, writer->depth);
+  fprintf(out, "  if (!runtime->concatenate(slots + %d, %d)) ",
+          writer->depth, count);
+  writeExit(writer, writer->depth);
+  fprintf(out, "\n");
+  writeReload(writer, first + 1);
+  fprintf(out, "  }\n");
+}
+
+static void writeJumpIfNotLess(Writer* writer) {
+  Chunk* chunk = writer->chunk;
+  uint8_t* code = chunk->code + writer->offset;
+  char b[32];
+  if (code[0] == OpJumpIfNotLessLocalConst) {
+    constantExpression(b, sizeof(b), chunk, code[2]);
+  } else {
+    snprintf(b, sizeof(b), "s%d", code[2]);
+  }
+  fprintf(writer->out, "  if (!IS_NUMBER(s%d) || !IS_NUMBER(%s)) ",
+          code[1], b);
+  writeExit(writer, writer->depth);
+  fprintf(writer->out, "\n  if (!(num(s%d) < num(%s))) goto L%d;\n",
+          code[1], b, jumpTarget(chunk, writer->offset));
+}
+
+// Writes the C for one instruction. Calls, returns and anything that
+// raises a runtime error leave to the interpreter at the instruction,
+// which does it over again.
+static void writeInstruction(Writer* writer) {
+  FILE* out = writer->out;
+  Chunk* chunk = writer->chunk;
+  uint8_t* code = chunk->code + writer->offset;
+  int top = writer->depth - 1;
+  char constant[32];
+  char local[16];
+  switch (code[0]) {
+    case OpConstant:
+      fprintf(out, "  s%d = %s;\n", top + 1, constantExpression(
+          constant, sizeof(constant), chunk, code[1]));
+      break;
+    case OpConstantLong:
+      fprintf(out, "  s%d = %s;\n", top + 1, constantExpression(
+          constant, sizeof(constant), chunk, readLong(code + 1)));
+      break;
+    case OpNil: fprintf(out, "  s%d = NIL_VAL;\n", top + 1); break;
+    case OpTrue: fprintf(out, "  s%d = TRUE_VAL;\n", top + 1); break;
+    case OpFalse: fprintf(out, "  s%d = FALSE_VAL;\n", top + 1); break;
+    case OpNegate:
+    case OpNegateUnchecked:
+      if (code[0] == OpNegate) writeNumberCheck(writer, top, top);
+      fprintf(out, "  s%d = val(-num(s%d));\n", top, top);
+      break;
+    case OpAdd:
+    case OpAddNum:
+    case OpAddStr: {
+      char a[16];
+      char b[16];
+      snprintf(a, sizeof(a), "s%d", top - 1);
+      snprintf(b, sizeof(b), "s%d", top);
+      writeAdd(writer, a, b, top - 1);
+      break;
+    }
+    case OpSubtract: writeArithmetic(writer, "-", true); break;
+    case OpMultiply: writeArithmetic(writer, "*", true); break;
+    case OpDivide: writeArithmetic(writer, "/", true); break;
+    case OpAddNumUnchecked: writeArithmetic(writer, "+", false); break;
+    case OpSubtractUnchecked: writeArithmetic(writer, "-", false); break;
+    case OpMultiplyUnchecked: writeArithmetic(writer, "*", false); break;
+    case OpDivideUnchecked: writeArithmetic(writer, "/", false); break;
+    case OpNot:
+      fprintf(out, "  s%d = BOOL_VAL(IS_FALSEY(s%d));\n", top, top);
+      break;
+    case OpEq:
+    case OpEqNum:
+      writeEquality(writer, true);
+      break;
+    case OpNotEq:
+    case OpNotEqNum:
+      writeEquality(writer, false);
+      break;
+    case OpGreater:
+    case OpGreaterUnchecked:
+      writeComparison(writer, "num(s%d) > num(s%d)",
+                      code[0] == OpGreater);
+      break;
+    case OpLess:
+    case OpLessUnchecked:
+      writeComparison(writer, "num(s%d) < num(s%d)",
+                      code[0] == OpLess);
+      break;
+    case OpGreaterEq:
+    case OpGreaterEqUnchecked:
+      writeComparison(writer, "!(num(s%d) < num(s%d))",
+                      code[0] == OpGreaterEq);
+      break;
+    case OpLessEq:
+    case OpLessEqUnchecked:
+      writeComparison(writer, "!(num(s%d) > num(s%d))",
+                      code[0] == OpLessEq);
+      break;
+    case OpPrint:
+      writeFlush(writer, writer->depth);
+      fprintf(out, "  runtime->print(slots + %d);\n", writer->depth);
+      writeReload(writer, top);
+      fprintf(out, "  s%d = NIL_VAL;\n", top);
+      break;
+    case OpPrintPop:
+      writeFlush(writer, writer->depth);
+      fprintf(out, "  runtime->print(slots + %d);\n", writer->depth);
+      writeReload(writer, top);
+      break;
+    case OpDefineGlobal:
+    case OpGetGlobal:
+    case OpSetGlobal:
+      writeGlobal(writer, code[0], code[1]);
+      break;
+    case OpDefineGlobalLong:
+    case OpGetGlobalLong:
+    case OpSetGlobalLong:
+      writeGlobal(writer, code[0], readLong(code + 1));
+      break;
+    case OpGetLocal:
+      fprintf(out, "  s%d = s%d;\n", top + 1, code[1]);
+      break;
+    case OpSetLocal:
+      fprintf(out, "  s%d = s%d;\n", code[1], top);
+      break;
+    case OpPop:
+    case OpPopN:
+      // The stack is one shorter from the next instruction on.
+      break;
+    case OpJumpIfFalse:
+    case OpJumpIfFalseLong:
+    case OpJumpIfFalsePop:
+      fprintf(out, "  if (IS_FALSEY(s%d)) goto L%d;\n", top,
+              jumpTarget(chunk, writer->offset));
+      break;
+    case OpJump:
+    case OpJumpLong:
+    case OpLoop:
+    case OpLoopLong:
+      fprintf(out, "  goto L%d;\n", jumpTarget(chunk, writer->offset));
+      break;
+    case OpConcatN:
+      writeConcatenation(writer, code[1]);
+      break;
+    case OpAddLocalConst:
+    case OpAddLocalConstNum:
+      snprintf(local, sizeof(local), "s%d", code[1]);
+      writeAdd(writer, local,
+               constantExpression(constant, sizeof(constant), chunk,
+                                  code[2]),
+               top + 1);
+      break;
+    case OpAddLocalConstUnchecked:
+      fprintf(out, "  s%d = val(num(s%d) + num(%s));\n", top + 1, code[1],
+              constantExpression(constant, sizeof(constant), chunk,
+                                 code[2]));
+      break;
+    case OpJumpIfNotLessLocalConst:
+    case OpJumpIfNotLessLocalLocal:
+      writeJumpIfNotLess(writer);
+      break;
+    default:
+      fprintf(out, "  ");
+      writeExit(writer, writer->depth);
+      fprintf(out, "\n");
+      break;
+  }
+}
+
+// Where an instruction can be entered from the interpreter, and where
+// a jump lands.
+#define LABEL_ENTRY  0x1
+#define LABEL_TARGET 0x2
+
+// Writes function as a C function that can be entered at its start and
+// after each of its calls, where the interpreter resumes it.
+static void writeFunction(FILE* out, ObjFunction* function, int index) {
+  Chunk* chunk = &function->chunk;
+  int* depths = ALLOCATE(int, chunk->count);
+  int maxDepth = stackDepths(chunk, function->arity + 1, depths);
+  // Labels are set on entries and on jump targets.
+  uint8_t* labels = ALLOCATE(uint8_t, chunk->count + 1);
+  memset(labels, 0, chunk->count + 1);
+  labels[0] = LABEL_ENTRY;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target != -1) labels[target] |= LABEL_TARGET;
+    if (chunk->code[offset] == OpCall) {
+      labels[offset + instructionLength(chunk, offset)] |= LABEL_ENTRY;
+    }
+  }
+
+  Writer writer;
+  writer.out = out;
+  writer.chunk = chunk;
+  writer.exits = ALLOCATE(bool, maxDepth + 1);
+  memset(writer.exits, 0, maxDepth + 1);
+
+  fprintf(out, "\n// %s\n", function->name == NULL
+                                ? "script" : function->name->chars);
+  fprintf(out, "static int function%d(const AotRuntime* runtime, "
+               "Value* constants,\n    Value* globals, Value* slots, "
+               "Value** stackTop, int offset) {\n", index);
+  for (int i = 0; i < maxDepth; i++) fprintf(out, "  Value s%d;\n", i);
+  fprintf(out, "  int resume;\n  switch (offset) {\n");
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (!(labels[offset] & LABEL_ENTRY) || depths[offset] == -1) continue;
+    fprintf(out, "    case %d:\n", offset);
+    for (int i = 0; i < depths[offset]; i++) {
+      fprintf(out, "      s%d = slots[%d];\n", i, i);
+    }
+    fprintf(out, "      goto L%d;\n", offset);
+  }
+  fprintf(out, "    default: return offset;\n  }\n");
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (depths[offset] == -1) continue;
+    if (labels[offset]) fprintf(out, "L%d:\n", offset);
+    writer.offset = offset;
+    writer.depth = depths[offset];
+    writeInstruction(&writer);
+  }
+
+  for (int depth = 0; depth <= maxDepth; depth++) {
+    if (!writer.exits[depth]) continue;
+    fprintf(out, "exit%d:\n", depth);
+    writeFlush(&writer, depth);
+    fprintf(out, "  *stackTop = slots + %d;\n  return resume;\n", depth);
+  }
+  fprintf(out, "}\n");
+
+  FREE_ARRAY(bool, writer.exits, maxDepth + 1);
+  FREE_ARRAY(uint8_t, labels, chunk->count + 1);
+  FREE_ARRAY(int, depths, chunk->count);
+}
+
+static void writeModule(FILE* out, FunctionList* list, const char* source) {
+  writePrelude(out);
+  for (int i = 0; i < list->count; i++) {
+    writeFunction(out, list->functions[i], i);
+  }
+
+  fprintf(out, "\nconst char mtiAotSource[] =\n  \"");
+  int column = 0;
+  for (const char* c = source; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if (*c >= ' ' && *c <= '~') {
+      fputc(*c, out);
+    } else {
+      fprintf(out, "\\%03o", (unsigned char)*c);
+    }
+    if (++column == 64 || *c == '\n') {
+      fprintf(out, "\"\n  \"");
+      column = 0;
+    }
+  }
+  fprintf(out, "\";\n");
+
+  fprintf(out, "const uint32_t mtiAotChecksum = %uu;\n", checksum(list));
+  fprintf(out, "const int mtiAotFunctionCount = %d;\n", list->count);
+  fprintf(out, "const AotFunction mtiAotFunctions[] = {\n");
+  for (int i = 0; i < list->count; i++) {
+    fprintf(out, "  function%d,\n", i);
+  }
+  fprintf(out, "};\n");
+}
+
+static bool endsWith(const char* string, const char* suffix) {
+  size_t length = strlen(string);
+  size_t suffixLength = strlen(suffix);
+  return length >= suffixLength &&
+         strcmp(string + length - suffixLength, suffix) == 0;
+}
+
+bool aotIsModule(const char* path) {
+  return endsWith(path, ".so");
+}
+
+bool aotBuild(ObjFunction* script, const char* source, const char* path) {
+  FILE* out;
+  bool isSource = endsWith(path, ".c");
+  if (isSource) {
+    out = fopen(path, "w");
+  } else {
+    // The path goes to the shell between single quotes.
+    if (strchr(path, '\'') != NULL) {
+      fprintf(stderr, "Can't build to \"%s\".\n", path);
+      return false;
+    }
+    const char* cc = getenv("CC");
+    if (cc == NULL) cc = "cc";
+    size_t length = strlen(cc) + strlen(path) + 64;
+    char* command = ALLOCATE(char, length);
+    snprintf(command, length, "%s -O2 -shared -fPIC -x c -o '%s' -",
+             cc, path);
+    out = popen(command, "w");
+    FREE_ARRAY(char, command, length);
+  }
+  if (out == NULL) {
+    fprintf(stderr, "Could not write \"%s\".\n", path);
+    return false;
+  }
+
+  push(OBJ_VAL(script));
+  FunctionList list = {NULL, 0, 0};
+  listFunctions(&list, script);
+  writeModule(out, &list, source);
+  FREE_ARRAY(ObjFunction*, list.functions, list.capacity);
+  pop();
+
+  if (isSource) return fclose(out) == 0;
+  if (pclose(out) != 0) {
+    fprintf(stderr, "Could not build \"%s\".\n", path);
+    return false;
+  }
+  return true;
+}
+
+ObjFunction* aotLoad(const char* path) {
+  // Without a slash dlopen() searches the library path instead.
+  size_t length = strlen(path) + 3;
+  char* relative = ALLOCATE(char, length);
+  snprintf(relative, length, "%s%s", strchr(path, '/') ? "" : "./", path);
+  void* module = dlopen(relative, RTLD_NOW | RTLD_LOCAL);
+  FREE_ARRAY(char, relative, length);
+  if (module == NULL) {
+    fprintf(stderr, "Could not load \"%s\": %s\n", path, dlerror());
+    return NULL;
+  }
+
+  const char* source = dlsym(module, "mtiAotSource");
+  const uint32_t* expected = dlsym(module, "mtiAotChecksum");
+  const int* count = dlsym(module, "mtiAotFunctionCount");
+  const AotFunction* functions = dlsym(module, "mtiAotFunctions");
+  if (source == NULL || expected == NULL || count == NULL ||
+      functions == NULL) {
+    fprintf(stderr, "\"%s\" wasn't built by mti --aot.\n", path);
+    dlclose(module);
+    return NULL;
+  }
+
+  ObjFunction* script = compile(source);
+  if (script == NULL) {
+    dlclose(module);
+    return NULL;
+  }
+
+  push(OBJ_VAL(script));
+  FunctionList list = {NULL, 0, 0};
+  listFunctions(&list, script);
+  bool matches = list.count == *count && checksum(&list) == *expected;
+  if (matches) {
+    for (int i = 0; i < list.count; i++) {
+      list.functions[i]->aot = functions[i];
+    }
+  }
+  FREE_ARRAY(ObjFunction*, list.functions, list.capacity);
+  pop();
+
+  if (!matches) {
+    fprintf(stderr, "\"%s\" was built by a different mti.\n", path);
+    dlclose(module);
+    return NULL;
+  }
+  // The module stays loaded for as long as its functions can run.
+  return script;
+}
+
+void aotRun(CallFrame* frame) {
+  Chunk* chunk = &frame->function->chunk;
+  Value* stackTop = vm.stackTop;
+  int offset = frame->function->aot(&runtime, chunk->constants.values,
+                                    vm.globalValues.values, frame->slots,
+                                    &stackTop,
+                                    (int)(frame->ip - chunk->code));
+  // A minor collection may have moved the function.
+  frame->ip = frame->function->chunk.code + offset;
+  vm.stackTop = stackTop;
+}
+#endif
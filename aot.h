@@ -0,0 +1,44 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#ifndef mti_aot_h
+#define mti_aot_h
+
+#include "object.h"
+#include "vm.h"
+
+#ifdef AOT
+// Writes C for every function in script, which was compiled from
+// source, and builds it into a shared object at path with the C
+// compiler named by $CC, or cc. If path ends in ".c" the C is written
+// there instead. Returns false, after saying why, if it couldn't.
+bool aotBuild(ObjFunction* script, const char* source, const char* path);
+
+// Loads a shared object built by aotBuild() and compiles the script it
+// was built from, with each function set to run its native code.
+// Returns NULL, after saying why, if it couldn't.
+ObjFunction* aotLoad(const char* path);
+
+// Returns whether path names a shared object for aotLoad() rather than
+// a script.
+bool aotIsModule(const char* path);
+
+// Runs frame in native code from frame->ip up to its next call, return
+// or runtime error, which are left to the interpreter. Returns with
+// frame->ip and vm.stackTop set to where the interpreter carries on.
+void aotRun(CallFrame* frame);
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+// Allocation throughput of reallocate() for small blocks. Keeps a
+// window of live blocks of random sizes and replaces one per round.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../memory.h"
+#include "../vm.h"
+
+#define LIVE 4096
+#define ROUNDS 20000000
+
+static void* blocks[LIVE];
+static size_t sizes[LIVE];
+
+int main() {
+  initVM();
+  // Nothing here is a GC root, so keep the collector out of the way.
+  vm.nextGC = (size_t)-1 / 2;
+
+  uint32_t seed = 1;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = 0; i < ROUNDS; i++) {
+    seed = seed * 1103515245 + 12345;
+    int index = (seed >> 8) % LIVE;
+    if (blocks[index] != NULL) {
+      reallocate(blocks[index], sizes[index], 0);
+    }
+
+    sizes[index] = 16 + (seed >> 20) % 200;
+    blocks[index] = reallocate(NULL, 0, sizes[index]);
+    *(char*)blocks[index] = 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%.1f M allocations/s\n", ROUNDS / seconds / 1e6);
+
+  for (int i = 0; i < LIVE; i++) {
+    if (blocks[i] != NULL) reallocate(blocks[i], sizes[i], 0);
+  }
+  freeVM();
+  return 0;
+}
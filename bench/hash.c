@@ -0,0 +1,82 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+// Throughput of hashString() against the byte-at-a-time FNV-1a hash it
+// replaced, for a range of string lengths.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../hash.h"
+
+#define TOTAL_BYTES (256 * 1024 * 1024)
+#define MAX_LENGTH 4096
+
+static char buffer[MAX_LENGTH + 64];
+
+static uint32_t hashFnv(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Returns GB/s. Each round hashes at a shifted offset and feeds the
+// previous result in so the calls can't be hoisted or overlapped.
+static double measure(uint32_t (*hash)(const char*, int), int length,
+                      uint32_t* sink) {
+  int rounds = TOTAL_BYTES / length;
+  uint32_t result = 0;
+
+  double start = now();
+  for (int i = 0; i < rounds; i++) {
+    result = hash(buffer + (result & 63), length);
+  }
+  double seconds = now() - start;
+
+  *sink ^= result;
+  return (double)rounds * length / seconds / 1e9;
+}
+
+int main() {
+  initHashSeed();
+  for (int i = 0; i < (int)sizeof(buffer); i++) {
+    buffer[i] = (char)('a' + i * 7 % 26);
+  }
+
+  static const int lengths[] = {3, 8, 16, 32, 64, 256, 1024, MAX_LENGTH};
+  uint32_t sink = 0;
+
+  printf("%8s %12s %12s\n", "length", "FNV-1a GB/s", "hash GB/s");
+  for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+    int length = lengths[i];
+    double fnv = measure(hashFnv, length, &sink);
+    double fast = measure(hashString, length, &sink);
+    printf("%8d %12.2f %12.2f\n", length, fnv, fast);
+  }
+
+  // Keep the results live.
+  if (sink == 1) printf(" ");
+  return 0;
+}
@@ -18,6 +18,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void initChunk(Chunk* chunk) {
   chunk->count = 0;
@@ -50,6 +51,188 @@ void freeChunk(Chunk* chunk) {
 }
 
 int addConstant(Chunk* chunk, Value value) {
+  push(value);
   writeValueArray(&chunk->constants, value);
+  pop();
   return chunk->constants.count - 1;
 }
+
+// Returns the size in bytes of the instruction at offset, including its
+// operands.
+int instructionLength(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OpConstant:
+    case OpDefineGlobal:
+    case OpGetGlobal:
+    case OpSetGlobal:
+    case OpGetLocal:
+    case OpSetLocal:
+    case OpCall:
+    case OpTailCall:
+    case OpConcatN:
+    case OpPopN:
+      return 2;
+    case OpJumpIfFalse:
+    case OpJump:
+    case OpLoop:
+    case OpAddLocalConst:
+    case OpAddLocalConstNum:
+    case OpAddLocalConstUnchecked:
+    case OpJumpIfFalsePop:
+      return 3;
+    case OpConstantLong:
+    case OpDefineGlobalLong:
+    case OpGetGlobalLong:
+    case OpSetGlobalLong:
+    case OpJumpIfFalseLong:
+    case OpJumpLong:
+    case OpLoopLong:
+      return 4;
+    case OpJumpIfNotLessLocalConst:
+    case OpJumpIfNotLessLocalLocal:
+      return 5;
+    default:
+      return 1;
+  }
+}
+
+// Returns where the jump at offset lands, or -1 if the instruction at
+// offset isn't a jump. The distance is always the last operand.
+int jumpTarget(Chunk* chunk, int offset) {
+  int end = offset + instructionLength(chunk, offset);
+  uint8_t* operand = chunk->code + end;
+
+  switch (chunk->code[offset]) {
+    case OpJumpIfFalse:
+    case OpJumpIfFalsePop:
+    case OpJumpIfNotLessLocalConst:
+    case OpJumpIfNotLessLocalLocal:
+    case OpJump:
+      return end + ((operand[-2] << 8) | operand[-1]);
+    case OpJumpIfFalseLong:
+    case OpJumpLong:
+      return end + ((operand[-3] << 16) | (operand[-2] << 8) | operand[-1]);
+    case OpLoop:
+      return end - ((operand[-2] << 8) | operand[-1]);
+    case OpLoopLong:
+      return end - ((operand[-3] << 16) | (operand[-2] << 8) | operand[-1]);
+    default:
+      return -1;
+  }
+}
+
+// Returns how many values the instruction at offset leaves on the stack
+// less the number it takes off when execution carries on after it.
+// OpJumpIfFalsePop only pops when it doesn't jump.
+int stackEffect(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OpConstant:
+    case OpConstantLong:
+    case OpNil:
+    case OpFalse:
+    case OpTrue:
+    case OpGetGlobal:
+    case OpGetGlobalLong:
+    case OpGetLocal:
+    case OpAddLocalConst:
+    case OpAddLocalConstNum:
+    case OpAddLocalConstUnchecked:
+      return 1;
+    case OpReturn:
+    case OpAdd:
+    case OpSubtract:
+    case OpMultiply:
+    case OpDivide:
+    case OpEq:
+    case OpGreater:
+    case OpLess:
+    case OpNotEq:
+    case OpGreaterEq:
+    case OpLessEq:
+    case OpPop:
+    case OpPrintPop:
+    case OpJumpIfFalsePop:
+    case OpAddNum:
+    case OpAddStr:
+    case OpEqNum:
+    case OpNotEqNum:
+    case OpAddNumUnchecked:
+    case OpSubtractUnchecked:
+    case OpMultiplyUnchecked:
+    case OpDivideUnchecked:
+    case OpGreaterUnchecked:
+    case OpLessUnchecked:
+    case OpGreaterEqUnchecked:
+    case OpLessEqUnchecked:
+      return -1;
+    case OpCall:
+    case OpTailCall:
+      return -chunk->code[offset + 1];
+    case OpConcatN:
+      return 1 - chunk->code[offset + 1];
+    case OpPopN:
+      return -chunk->code[offset + 1];
+    default:
+      return 0;
+  }
+}
+
+uint8_t checkedInstruction(uint8_t instruction) {
+  switch (instruction) {
+    case OpAddNumUnchecked: return OpAdd;
+    case OpSubtractUnchecked: return OpSubtract;
+    case OpMultiplyUnchecked: return OpMultiply;
+    case OpDivideUnchecked: return OpDivide;
+    case OpNegateUnchecked: return OpNegate;
+    case OpGreaterUnchecked: return OpGreater;
+    case OpLessUnchecked: return OpLess;
+    case OpGreaterEqUnchecked: return OpGreaterEq;
+    case OpLessEqUnchecked: return OpLessEq;
+    case OpAddLocalConstUnchecked: return OpAddLocalConst;
+    default: return instruction;
+  }
+}
+
+static void visitDepth(int* depths, int* worklist, int* count,
+                       int offset, int depth) {
+  if (depths[offset] != -1) return;
+  depths[offset] = depth;
+  worklist[(*count)++] = offset;
+}
+
+// The compiler leaves the stack at the same depth on every path into an
+// instruction, so each is only visited once.
+int stackDepths(Chunk* chunk, int depth, int* depths) {
+  int* worklist = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+  int count = 0;
+  int max = depth;
+  visitDepth(depths, worklist, &count, 0, depth);
+  while (count > 0) {
+    int offset = worklist[--count];
+    uint8_t instruction = chunk->code[offset];
+    int after = depths[offset] + stackEffect(chunk, offset);
+    if (after > max) max = after;
+    // Adding strings pushes both operands before joining them.
+    if (instruction == OpAddLocalConst && after + 1 > max) max = after + 1;
+
+    int target = jumpTarget(chunk, offset);
+    if (target != -1 && target < chunk->count) {
+      visitDepth(depths, worklist, &count, target,
+                 instruction == OpJumpIfFalsePop ? after + 1 : after);
+    }
+
+    int next = offset + instructionLength(chunk, offset);
+    bool fallsThrough = instruction != OpReturn &&
+        instruction != OpTailCall && instruction != OpJump &&
+        instruction != OpJumpLong && instruction != OpLoop &&
+        instruction != OpLoopLong;
+    if (fallsThrough && next < chunk->count) {
+      visitDepth(depths, worklist, &count, next, after);
+    }
+  }
+
+  FREE_ARRAY(int, worklist, chunk->count);
+  return max;
+}
@@ -22,6 +22,7 @@
 typedef enum {
   OpReturn,
   OpConstant,
+  OpConstantLong,
   OpNegate,
   OpAdd,
   OpSubtract,
@@ -34,19 +35,56 @@ typedef enum {
   OpEq,
   OpGreater,
   OpLess,
+  OpNotEq,
+  OpGreaterEq,
+  OpLessEq,
   OpPrint,
   OpDefineGlobal,
+  OpDefineGlobalLong,
   OpGetGlobal,
+  OpGetGlobalLong,
   OpSetGlobal,
+  OpSetGlobalLong,
   OpGetLocal,
   OpSetLocal,
   OpPop,
-  OpLocalPop,
-  OpCopyValToLocal,
+  OpPopN,
   OpJumpIfFalse,
+  OpJumpIfFalseLong,
   OpJump,
+  OpJumpLong,
   OpLoop,
+  OpLoopLong,
   OpCall,
+  OpTailCall,
+  OpConcatN,
+  // Superinstructions, only emitted by the peephole pass. Each one
+  // stands for the sequence in its name.
+  OpAddLocalConst,
+  OpJumpIfFalsePop,
+  OpJumpIfNotLessLocalConst,
+  OpJumpIfNotLessLocalLocal,
+  OpPrintPop,
+  // Quickened forms. The VM writes these over the generic instruction
+  // once it has run with operands of one type, and writes the generic
+  // one back when the operands stop matching.
+  OpAddNum,
+  OpAddStr,
+  OpEqNum,
+  OpNotEqNum,
+  OpAddLocalConstNum,
+  // Unchecked forms. The compiler only emits these where type inference
+  // has proved every operand is a number, so they skip the type checks.
+  OpAddNumUnchecked,
+  OpSubtractUnchecked,
+  OpMultiplyUnchecked,
+  OpDivideUnchecked,
+  OpNegateUnchecked,
+  OpGreaterUnchecked,
+  OpLessUnchecked,
+  OpGreaterEqUnchecked,
+  OpLessEqUnchecked,
+  OpAddLocalConstUnchecked,
 } OpCode;
 
 typedef struct {
@@ -61,5 +99,15 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(Chunk* chunk, int offset);
+int jumpTarget(Chunk* chunk, int offset);
+int stackEffect(Chunk* chunk, int offset);
+// Returns the generic instruction an unchecked one stands for, or the
+// instruction itself if it isn't unchecked.
+uint8_t checkedInstruction(uint8_t instruction);
+// Fills depths with the number of values on the stack before each
+// instruction runs, starting from depth, and returns the most there
+// ever are. Instructions nothing reaches get -1.
+int stackDepths(Chunk* chunk, int depth, int* depths);
 
 #endif
@@ -16,9 +16,56 @@
 #ifndef mti_common_h
 #define mti_common_h
 
+// Pack every Value into a single quiet-NaN-tagged 64-bit word instead
+// of a tagged union.
+#define NAN_BOXING
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
+// Serve small allocations from per-size-class free lists instead of
+// going to malloc() for each one. Remove to use the C allocator
+// directly.
+#define POOL_ALLOCATOR
+
+// Run the peephole pass over each chunk once it is compiled. Remove to
+// execute the code exactly as the compiler emitted it.
+#define PEEPHOLE
+
+// Work out which locals and stack values are always numbers once a
+// chunk is compiled and emit the unchecked forms of the instructions
+// that use them. Remove to keep every runtime type check.
+#define INFER_TYPES
+
+// Collect on every allocation and/or log each collection.
+//#define DEBUG_STRESS_GC
+//#define DEBUG_LOG_GC
+
+// Count the pairs of instructions the VM runs back to back and print
+// the most frequent ones on exit.
+//#define DEBUG_PROFILE_PAIRS
+
+// Dispatch the interpreter loop through a table of label addresses
+// when the compiler supports it. Define NO_COMPUTED_GOTO to fall back
+// to the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Compile functions that are called often to x86-64 machine code. Needs
+// NaN boxing and x86-64 Linux. Define NO_JIT to always interpret.
+#if defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__) && \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+// Let 'mti --aot' build a script into a shared object of C functions
+// that runs in place of its bytecode. Needs NaN boxing and dlopen().
+// Define NO_AOT to leave it out.
+#if defined(NAN_BOXING) && defined(__unix__) && !defined(NO_AOT)
+#define AOT
+#endif
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
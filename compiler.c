@@ -20,7 +20,9 @@
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
+#include "memory.h"
 #include "object.h"
+#include "peephole.h"
 
 
 #ifdef DEBUG_PRINT_CODE
@@ -52,6 +54,8 @@ typedef enum {
 } Precedence;
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+// The largest operand of the long instruction forms.
+#define UINT24_MAX 0xffffff
 
 typedef struct {
   Token name;
@@ -63,6 +67,19 @@ typedef enum {
   TypeScript
 } FunctionType;
 
+#define FOLD_DEPTH 8
+
+// A constant push at the end of the chunk. An operator applied to it
+// can be replaced along with it by a push of the result.
+typedef struct {
+  int start;
+  int end;
+  Value value;
+  // The constant the push added to the pool, or -1 if it reused one or
+  // needs none.
+  int added;
+} Foldable;
+
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
@@ -71,6 +88,30 @@ typedef struct Compiler {
   Local locals[UINT8_COUNT];
   int localCount;
   int scopeDepth;
+
+  Foldable foldables[FOLD_DEPTH];
+  int foldableCount;
+  // Folding never removes code before this offset since a jump lands
+  // there.
+  int foldBarrier;
+
+  // Open-addressed index from constant value to its slot in the chunk,
+  // so each value is only stored once. Holds the slot plus one, or 0.
+  int* constantIndex;
+  int constantCapacity;
+
+  // Operand offsets of the jumps that haven't been patched yet, by
+  // handle, or -1 for a free handle. Widening a jump moves the code
+  // after it, so these are kept where they can be updated.
+  int* jumps;
+  int jumpCount;
+  int jumpCapacity;
+  // Bumped whenever jumps are widened.
+  int widenings;
+
+  // Offset of the last OpCall, or -1. A call that ends up as the last
+  // instruction before a return becomes an OpTailCall.
+  int lastCall;
 } Compiler;
 
 typedef void (*ParseFn)(bool canAssign);
@@ -90,6 +131,15 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->foldableCount = 0;
+  compiler->foldBarrier = 0;
+  compiler->constantIndex = NULL;
+  compiler->constantCapacity = 0;
+  compiler->jumps = NULL;
+  compiler->jumpCount = 0;
+  compiler->jumpCapacity = 0;
+  compiler->widenings = 0;
+  compiler->lastCall = -1;
   compiler->function = newFunction();
   current = compiler;
 
@@ -97,6 +147,8 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   if (type != TypeScript) {
     current->function->name = copyString(parser.previous.start,
                                          parser.previous.length);
+    writeBarrier((Obj*)current->function,
+                 OBJ_VAL(current->function->name));
   }
 
 
@@ -175,57 +227,728 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OpLoop);
+static void emitLong(int operand) {
+  emitByte((operand >> 16) & 0xff);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+// Emits an instruction with an index operand, using the long form with
+// a 24-bit operand only when the index doesn't fit in a byte.
+static void emitIndexed(uint8_t instruction, uint8_t longInstruction,
+                        int index) {
+  if (index <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)index);
+  } else {
+    emitByte(longInstruction);
+    emitLong(index);
+  }
+}
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+static void emitLoop(int loopStart) {
+  // +3 for the instruction itself.
+  int offset = currentChunk()->count - loopStart + 3;
+  if (offset <= UINT16_MAX) {
+    emitByte(OpLoop);
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
+    return;
+  }
+
+  offset++;
+  if (offset > UINT24_MAX) error("Loop body too large.");
+  emitByte(OpLoopLong);
+  emitLong(offset);
 }
 
+// Emits a forward jump with a 16-bit placeholder and returns a handle
+// for patchJump().
 static int emitJump(uint8_t instruction) {
   emitByte(instruction);
   emitByte(0xff);
   emitByte(0xff);
-  return currentChunk()->count - 2;
+
+  int jump = 0;
+  while (jump < current->jumpCount && current->jumps[jump] != -1) {
+    jump++;
+  }
+
+  if (jump == current->jumpCount) {
+    if (current->jumpCapacity < current->jumpCount + 1) {
+      int oldCapacity = current->jumpCapacity;
+      current->jumpCapacity = GROW_CAPACITY(oldCapacity);
+      current->jumps = GROW_ARRAY(int, current->jumps, oldCapacity,
+                                  current->jumpCapacity);
+    }
+    current->jumpCount++;
+  }
+
+  current->jumps[jump] = currentChunk()->count - 2;
+  return jump;
 }
 
 static void emitReturn() {
   emitByte(OpReturn);
 }
 
-static uint8_t makeConstant(Value value) {
+// Compares constants by representation so that 0 and -0 stay apart.
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) return false;
+  if (IS_NUMBER(a)) {
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  }
+  return valuesEqual(a, b);
+#endif
+}
+
+static uint32_t hashConstant(Value value) {
+  uint64_t bits;
+#ifdef NAN_BOXING
+  bits = value;
+#else
+  if (IS_NUMBER(value)) {
+    memcpy(&bits, &value.as.number, sizeof(bits));
+  } else if (IS_OBJ(value)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  } else {
+    bits = ((uint64_t)value.type << 1) | (IS_BOOL(value) && AS_BOOL(value));
+  }
+#endif
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Returns the slot in the index where value is or would go.
+static int findConstantSlot(int* index, int capacity, Value value) {
+  Value* constants = currentChunk()->constants.values;
+  int slot = hashConstant(value) & (capacity - 1);
+  while (index[slot] != 0 &&
+         !sameConstant(constants[index[slot] - 1], value)) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return slot;
+}
+
+static void indexConstant(int constant) {
+  ValueArray* constants = &currentChunk()->constants;
+  if (constants->count * 2 > current->constantCapacity) {
+    int capacity = GROW_CAPACITY(current->constantCapacity);
+    int* index = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++) index[i] = 0;
+
+    // Every constant but the new one is already in the index.
+    for (int i = 0; i < constants->count - 1; i++) {
+      index[findConstantSlot(index, capacity, constants->values[i])] =
+          i + 1;
+    }
+
+    FREE_ARRAY(int, current->constantIndex, current->constantCapacity);
+    current->constantIndex = index;
+    current->constantCapacity = capacity;
+  }
+
+  int slot = findConstantSlot(current->constantIndex,
+                              current->constantCapacity,
+                              constants->values[constant]);
+  current->constantIndex[slot] = constant + 1;
+}
+
+// Takes the last constant out of the pool and the index. The entries
+// after it in its probe run move back so lookups still reach them.
+static void removeLastConstant() {
+  ValueArray* constants = &currentChunk()->constants;
+  int mask = current->constantCapacity - 1;
+  int* index = current->constantIndex;
+  int hole = findConstantSlot(index, current->constantCapacity,
+                              constants->values[constants->count - 1]);
+  index[hole] = 0;
+
+  for (int slot = (hole + 1) & mask; index[slot] != 0;
+       slot = (slot + 1) & mask) {
+    int home = hashConstant(constants->values[index[slot] - 1]) & mask;
+    // Moves unless home lies cyclically in (hole, slot].
+    bool stays = hole < slot ? home > hole && home <= slot
+                             : home > hole || home <= slot;
+    if (!stays) {
+      index[hole] = index[slot];
+      index[slot] = 0;
+      hole = slot;
+    }
+  }
+
+  constants->count--;
+}
+
+static int makeConstant(Value value) {
+  if (current->constantCapacity > 0) {
+    int slot = findConstantSlot(current->constantIndex,
+                                current->constantCapacity, value);
+    if (current->constantIndex[slot] != 0) {
+      return current->constantIndex[slot] - 1;
+    }
+  }
+
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  writeBarrier((Obj*)current->function, value);
+  if (constant > UINT24_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  indexConstant(constant);
+  return constant;
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static void recordFoldable(int start, Value value, int added) {
+  // Only the most recent pushes can still be folded.
+  if (current->foldableCount == FOLD_DEPTH) {
+    memmove(current->foldables, current->foldables + 1,
+            sizeof(Foldable) * (FOLD_DEPTH - 1));
+    current->foldableCount--;
+  }
+
+  Foldable* foldable = &current->foldables[current->foldableCount++];
+  foldable->start = start;
+  foldable->end = currentChunk()->count;
+  foldable->value = value;
+  foldable->added = added;
+}
+
+// Returns whether the last count instructions in the chunk are constant
+// pushes that can be folded away, storing their values in push order.
+static bool tailConstants(int count, Value* values) {
+  if (current->foldableCount < count) return false;
+
+  int end = currentChunk()->count;
+  for (int i = 0; i < count; i++) {
+    Foldable* foldable =
+        &current->foldables[current->foldableCount - 1 - i];
+    if (foldable->end != end || foldable->start < current->foldBarrier) {
+      return false;
+    }
+
+    values[count - 1 - i] = foldable->value;
+    end = foldable->start;
+  }
+
+  return true;
+}
+
+// Removes the pushes found by tailConstants(). Constants they added
+// go too while they are the last in the pool, since no other code can
+// have used them yet.
+static void dropConstants(int count) {
+  ValueArray* constants = &currentChunk()->constants;
+  for (int i = 0; i < count; i++) {
+    Foldable* foldable = &current->foldables[--current->foldableCount];
+    if (foldable->added != -1 && foldable->added == constants->count - 1) {
+      removeLastConstant();
+    }
+  }
+  currentChunk()->count = current->foldables[current->foldableCount].start;
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OpConstant, makeConstant(value));
+  int start = currentChunk()->count;
+  int added = -1;
+  if (IS_NIL(value)) {
+    emitByte(OpNil);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OpTrue : OpFalse);
+  } else {
+    int count = currentChunk()->constants.count;
+    int constant = makeConstant(value);
+    if (currentChunk()->constants.count > count) added = constant;
+    emitIndexed(OpConstant, OpConstantLong, constant);
+  }
+
+  recordFoldable(start, value, added);
+}
+
+static bool isJump(uint8_t instruction) {
+  switch (instruction) {
+    case OpJumpIfFalse:
+    case OpJumpIfFalseLong:
+    case OpJump:
+    case OpJumpLong:
+    case OpLoop:
+    case OpLoopLong:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static uint8_t longJump(uint8_t instruction) {
+  switch (instruction) {
+    case OpJumpIfFalse: return OpJumpIfFalseLong;
+    case OpJump:        return OpJumpLong;
+    case OpLoop:        return OpLoopLong;
+    default:            return instruction;
+  }
+}
+
+typedef struct {
+  int offset;
+  // Where the jump lands, or -1 if it hasn't been patched yet.
+  int target;
+  bool isLong;
+  bool widen;
+} JumpSite;
+
+// Returns where offset moves to once the sites before it are widened.
+// shifts[i] is the number of sites widened before sites[i].
+static int widenedOffset(JumpSite* sites, int* shifts, int count,
+                         int offset) {
+  int low = 0;
+  int high = count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (sites[middle].offset < offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return offset + shifts[low];
+}
+
+// Patches the jump whose operand is at patched to land at the end of
+// the chunk when that is too far for 16 bits. The jump becomes a long
+// jump, which moves the code after it and can push other jumps over
+// the limit in turn, so all jumps in the chunk are relaxed together
+// and the code rewritten once with the new offsets.
+static void widenJumps(int patched) {
+  Chunk* chunk = currentChunk();
+
+  JumpSite* sites = NULL;
+  int count = 0;
+  int capacity = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (!isJump(instruction)) continue;
+
+    if (capacity < count + 1) {
+      int oldCapacity = capacity;
+      capacity = GROW_CAPACITY(oldCapacity);
+      sites = GROW_ARRAY(JumpSite, sites, oldCapacity, capacity);
+    }
+
+    JumpSite* site = &sites[count++];
+    site->offset = offset;
+    site->isLong = longJump(instruction) == instruction;
+    site->widen = false;
+    site->target = -1;
+
+    int length = site->isLong ? 4 : 3;
+    bool pending = false;
+    for (int i = 0; i < current->jumpCount; i++) {
+      if (current->jumps[i] == offset + 1) pending = true;
+    }
+
+    if (offset + 1 == patched) {
+      site->target = chunk->count;
+    } else if (!pending) {
+      int distance = site->isLong
+          ? (chunk->code[offset + 1] << 16) |
+            (chunk->code[offset + 2] << 8) | chunk->code[offset + 3]
+          : (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      bool backward = instruction == OpLoop || instruction == OpLoopLong;
+      site->target = offset + length + (backward ? -distance : distance);
+    }
+  }
+
+  int* shifts = ALLOCATE(int, count + 1);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    shifts[0] = 0;
+    for (int i = 0; i < count; i++) {
+      shifts[i + 1] = shifts[i] + (sites[i].widen ? 1 : 0);
+    }
+
+    for (int i = 0; i < count; i++) {
+      JumpSite* site = &sites[i];
+      if (site->isLong || site->target == -1) continue;
+
+      int end = site->offset + shifts[i] + 3;
+      int target = widenedOffset(sites, shifts, count, site->target);
+      int distance = target > end ? target - end : end - target;
+      if (distance > UINT16_MAX) {
+        site->isLong = true;
+        site->widen = true;
+        changed = true;
+      }
+    }
+  }
+
+  // Grow the chunk, then move everything up from the back so nothing
+  // is overwritten before it has been copied.
+  int oldCount = chunk->count;
+  int line = chunk->lines[oldCount - 1];
+  for (int i = 0; i < shifts[count]; i++) writeChunk(chunk, 0, line);
+
+  for (int i = count - 1; i >= -1; i--) {
+    int from = i >= 0
+        ? sites[i].offset + (sites[i].isLong && !sites[i].widen ? 4 : 3)
+        : 0;
+    int to = i + 1 < count ? sites[i + 1].offset : oldCount;
+    int shift = shifts[i + 1];
+    memmove(chunk->code + from + shift, chunk->code + from, to - from);
+    memmove(chunk->lines + from + shift, chunk->lines + from,
+            sizeof(int) * (to - from));
+    if (i < 0) break;
+
+    JumpSite* site = &sites[i];
+    uint8_t instruction = chunk->code[site->offset];
+    int siteLine = chunk->lines[site->offset];
+    int at = site->offset + shifts[i];
+    int length = site->isLong ? 4 : 3;
+    for (int j = 0; j < length; j++) chunk->lines[at + j] = siteLine;
+
+    if (site->target == -1) {
+      // Still pending, so keep the placeholder.
+      chunk->code[at] = instruction;
+      chunk->code[at + 1] = 0xff;
+      chunk->code[at + 2] = 0xff;
+      continue;
+    }
+
+    int target = widenedOffset(sites, shifts, count, site->target);
+    int distance = target > at + length
+        ? target - (at + length) : at + length - target;
+    if (distance > UINT24_MAX) error("Too much code to jump over.");
+
+    if (site->isLong) {
+      chunk->code[at] = longJump(instruction);
+      chunk->code[at + 1] = (distance >> 16) & 0xff;
+      chunk->code[at + 2] = (distance >> 8) & 0xff;
+      chunk->code[at + 3] = distance & 0xff;
+    } else {
+      chunk->code[at] = instruction;
+      chunk->code[at + 1] = (distance >> 8) & 0xff;
+      chunk->code[at + 2] = distance & 0xff;
+    }
+  }
+
+  for (int i = 0; i < current->jumpCount; i++) {
+    if (current->jumps[i] == -1) continue;
+    current->jumps[i] = widenedOffset(sites, shifts, count,
+                                      current->jumps[i] - 1) + 1;
+  }
+  current->foldBarrier = widenedOffset(sites, shifts, count,
+                                       current->foldBarrier);
+  if (current->lastCall != -1) {
+    current->lastCall = widenedOffset(sites, shifts, count,
+                                      current->lastCall);
+  }
+  current->foldableCount = 0;
+  current->widenings++;
+
+  FREE_ARRAY(int, shifts, count + 1);
+  FREE_ARRAY(JumpSite, sites, capacity);
 }
 
-static void patchJump(int offset) {
+static void patchJump(int jump) {
+  int offset = current->jumps[jump];
   // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+  int distance = currentChunk()->count - offset - 2;
+
+  if (distance > UINT16_MAX) {
+    widenJumps(offset);
+  } else {
+    currentChunk()->code[offset] = (distance >> 8) & 0xff;
+    currentChunk()->code[offset + 1] = distance & 0xff;
+  }
+
+  current->jumps[jump] = -1;
+  while (current->jumpCount > 0 &&
+         current->jumps[current->jumpCount - 1] == -1) {
+    current->jumpCount--;
+  }
+  current->foldBarrier = currentChunk()->count;
+}
+
+// Replaces the code from start on with the code between from and end,
+// which must not jump outside itself.
+static void keepCode(int start, int from, int end) {
+  Chunk* chunk = currentChunk();
+  memmove(chunk->code + start, chunk->code + from, end - from);
+  memmove(chunk->lines + start, chunk->lines + from,
+          sizeof(int) * (end - from));
+  chunk->count = start + (end - from);
+
+  if (current->lastCall >= from && current->lastCall < end) {
+    current->lastCall -= from - start;
+  } else {
+    current->lastCall = -1;
+  }
+  current->foldableCount = 0;
+  current->foldBarrier = chunk->count;
+}
+
+// Finds the deepest the stack gets while the chunk runs, starting from
+// depth values.
+static int maxStackDepth(Chunk* chunk, int depth) {
+  int* depths = ALLOCATE(int, chunk->count);
+  int max = stackDepths(chunk, depth, depths);
+  FREE_ARRAY(int, depths, chunk->count);
+  return max;
+}
+
+#ifdef INFER_TYPES
+// What type inference knows about a local or a value on the stack.
+typedef enum {
+  TYPE_UNKNOWN,
+  TYPE_NUMBER,
+} InferredType;
+
+typedef struct {
+  Chunk* chunk;
+  int* depths;
+  // The types on entry to each jump target, once a jump has reached it.
+  uint8_t** entries;
+  // The types of the locals and stack values before the current
+  // instruction.
+  uint8_t* types;
+  bool changed;
+} Inference;
+
+// Merges types into those on entry to target. A value stays a number
+// only if it is one on every path in.
+static void mergeTypes(Inference* inference, int target, uint8_t* types) {
+  int depth = inference->depths[target];
+  uint8_t* entry = inference->entries[target];
+  if (entry == NULL) {
+    entry = ALLOCATE(uint8_t, depth + 1);
+    memcpy(entry, types, depth);
+    inference->entries[target] = entry;
+    inference->changed = true;
+    return;
+  }
+
+  for (int i = 0; i < depth; i++) {
+    if (entry[i] != types[i] && entry[i] != TYPE_UNKNOWN) {
+      entry[i] = TYPE_UNKNOWN;
+      inference->changed = true;
+    }
+  }
+}
 
-  if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+static uint8_t uncheckedInstruction(uint8_t instruction) {
+  switch (instruction) {
+    case OpAdd: return OpAddNumUnchecked;
+    case OpSubtract: return OpSubtractUnchecked;
+    case OpMultiply: return OpMultiplyUnchecked;
+    case OpDivide: return OpDivideUnchecked;
+    case OpNegate: return OpNegateUnchecked;
+    case OpGreater: return OpGreaterUnchecked;
+    case OpLess: return OpLessUnchecked;
+    case OpGreaterEq: return OpGreaterEqUnchecked;
+    case OpLessEq: return OpLessEqUnchecked;
+    case OpAddLocalConst: return OpAddLocalConstUnchecked;
+    default: return instruction;
   }
+}
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+static uint8_t constantType(Chunk* chunk, int index) {
+  return IS_NUMBER(chunk->constants.values[index]) ? TYPE_NUMBER
+                                                   : TYPE_UNKNOWN;
 }
 
+// Applies the instruction at offset to the types. With rewrite set, an
+// instruction whose operands are proved to be numbers is replaced with
+// its unchecked form. Operands that aren't numbers make arithmetic a
+// runtime error, so its result is always a number unless it added
+// strings.
+static void inferInstruction(Inference* inference, int offset,
+                             bool rewrite) {
+  Chunk* chunk = inference->chunk;
+  uint8_t* code = chunk->code + offset;
+  uint8_t* types = inference->types;
+  int depth = inference->depths[offset];
+  uint8_t instruction = code[0];
+  bool numbers;
+
+  switch (instruction) {
+    case OpConstant:
+      types[depth] = constantType(chunk, code[1]);
+      break;
+    case OpConstantLong:
+      types[depth] = constantType(chunk,
+          (code[1] << 16) | (code[2] << 8) | code[3]);
+      break;
+    case OpNil:
+    case OpTrue:
+    case OpFalse:
+    case OpGetGlobal:
+    case OpGetGlobalLong:
+      types[depth] = TYPE_UNKNOWN;
+      break;
+    case OpNegate:
+      if (rewrite && types[depth - 1] == TYPE_NUMBER) {
+        code[0] = OpNegateUnchecked;
+      }
+      types[depth - 1] = TYPE_NUMBER;
+      break;
+    case OpAdd:
+    case OpSubtract:
+    case OpMultiply:
+    case OpDivide:
+    case OpGreater:
+    case OpLess:
+    case OpGreaterEq:
+    case OpLessEq:
+      numbers = types[depth - 2] == TYPE_NUMBER &&
+                types[depth - 1] == TYPE_NUMBER;
+      if (rewrite && numbers) code[0] = uncheckedInstruction(instruction);
+      types[depth - 2] = instruction == OpSubtract ||
+                         instruction == OpMultiply ||
+                         instruction == OpDivide ||
+                         (instruction == OpAdd && numbers)
+                         ? TYPE_NUMBER : TYPE_UNKNOWN;
+      break;
+    case OpEq:
+    case OpNotEq:
+      types[depth - 2] = TYPE_UNKNOWN;
+      break;
+    case OpNot:
+    case OpPrint:
+      types[depth - 1] = TYPE_UNKNOWN;
+      break;
+    case OpGetLocal:
+      types[depth] = types[code[1]];
+      break;
+    case OpSetLocal:
+      types[code[1]] = types[depth - 1];
+      break;
+    case OpCall:
+      types[depth - 1 - code[1]] = TYPE_UNKNOWN;
+      break;
+    case OpConcatN:
+      // Only strings and numbers can be joined.
+      numbers = true;
+      for (int i = depth - code[1]; i < depth; i++) {
+        if (types[i] != TYPE_NUMBER) numbers = false;
+      }
+      types[depth - code[1]] = numbers ? TYPE_NUMBER : TYPE_UNKNOWN;
+      break;
+    case OpAddLocalConst:
+      numbers = types[code[1]] == TYPE_NUMBER &&
+                constantType(chunk, code[2]) == TYPE_NUMBER;
+      if (rewrite && numbers) code[0] = OpAddLocalConstUnchecked;
+      types[depth] = numbers ? TYPE_NUMBER : TYPE_UNKNOWN;
+      break;
+    // Comparing anything but numbers is an error, so past the jump the
+    // locals are numbers whichever way it goes.
+    case OpJumpIfNotLessLocalConst:
+      types[code[1]] = TYPE_NUMBER;
+      break;
+    case OpJumpIfNotLessLocalLocal:
+      types[code[1]] = TYPE_NUMBER;
+      types[code[2]] = TYPE_NUMBER;
+      break;
+    default:
+      // The rest only take values off the stack or leave it alone.
+      break;
+  }
+}
+
+// Carries the types through the chunk in order, from each instruction
+// to the next and to where it jumps. Returns whether the types on entry
+// to any jump target changed, in which case it needs another pass.
+static bool inferPass(Inference* inference, int arity, bool rewrite) {
+  Chunk* chunk = inference->chunk;
+  uint8_t* types = inference->types;
+  inference->changed = false;
+  // Nothing is known about the callee and its arguments.
+  for (int i = 0; i <= arity; i++) types[i] = TYPE_UNKNOWN;
+
+  bool reached = true;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int depth = inference->depths[offset];
+    if (depth == -1) {
+      reached = false;
+      continue;
+    }
+
+    if (inference->entries[offset] != NULL) {
+      if (reached) mergeTypes(inference, offset, types);
+      memcpy(types, inference->entries[offset], depth);
+      reached = true;
+    }
+    // Code only a later jump leads to waits for the next pass.
+    if (!reached) continue;
+
+    inferInstruction(inference, offset, rewrite);
+    int target = jumpTarget(chunk, offset);
+    if (target != -1 && target < chunk->count) {
+      mergeTypes(inference, target, types);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    reached = instruction != OpReturn && instruction != OpTailCall &&
+        instruction != OpJump && instruction != OpJumpLong &&
+        instruction != OpLoop && instruction != OpLoopLong;
+  }
+  return inference->changed;
+}
+
+// Finds the locals and stack values that are always numbers and uses
+// the unchecked forms of the instructions that only ever see numbers.
+static void inferTypes(Chunk* chunk, int arity) {
+  Inference inference;
+  inference.chunk = chunk;
+  inference.depths = ALLOCATE(int, chunk->count);
+  int max = stackDepths(chunk, arity + 1, inference.depths);
+  inference.entries = ALLOCATE(uint8_t*, chunk->count);
+  for (int i = 0; i < chunk->count; i++) inference.entries[i] = NULL;
+  inference.types = ALLOCATE(uint8_t, max + 1);
+
+  while (inferPass(&inference, arity, false));
+  // The types no longer change, so they hold everywhere.
+  inferPass(&inference, arity, true);
+
+  for (int i = 0; i < chunk->count; i++) {
+    if (inference.entries[i] != NULL) {
+      FREE_ARRAY(uint8_t, inference.entries[i],
+                 inference.depths[i] + 1);
+    }
+  }
+  FREE_ARRAY(uint8_t, inference.types, max + 1);
+  FREE_ARRAY(uint8_t*, inference.entries, chunk->count);
+  FREE_ARRAY(int, inference.depths, chunk->count);
+}
+#endif
+
 static ObjFunction* endCompiler() {
   emitReturn();
 
   ObjFunction* function = current->function;
+#ifdef PEEPHOLE
+  if (!parser.hadError) optimizeChunk(currentChunk());
+#endif
+#ifdef INFER_TYPES
+  if (!parser.hadError) inferTypes(currentChunk(), function->arity);
+#endif
+  if (!parser.hadError) {
+    // The callee and its arguments are on the stack to begin with.
+    function->maxStack = maxStackDepth(currentChunk(),
+                                       function->arity + 1);
+  }
+  FREE_ARRAY(int, current->constantIndex, current->constantCapacity);
+  FREE_ARRAY(int, current->jumps, current->jumpCapacity);
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
       disassembleChunk(currentChunk(), function->name != NULL
@@ -240,9 +963,25 @@ static void expression();
 static void parsePrecedence(Precedence precedence);
 static ParseRule* getRule(TokenType type);
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start,
-                                         name->length)));
+static int globalSlot(Token* name) {
+  ObjString* string = copyString(name->start, name->length);
+  Value index;
+  if (tableGet(&vm.globals, string, &index)) {
+    return (int)AS_NUMBER(index);
+  }
+
+  int slot = vm.globalValues.count;
+  if (slot > UINT24_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+
+  push(OBJ_VAL(string));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(string));
+  tableSet(&vm.globals, string, NUMBER_VAL((double)slot));
+  pop();
+  return slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -293,13 +1032,161 @@ static void declareVariable() {
   addLocal(*name);
 }
 
+// Adds the last two operands of a '+' chain at compile time if they
+// are constants. Strings concatenate the same wherever they are in the
+// chain, but numbers are only folded at the start since floating-point
+// addition isn't associative.
+static bool foldAdd(bool atStart) {
+  Value operands[2];
+  if (!tailConstants(2, operands)) return false;
+
+  Value result;
+  if (IS_STRING(operands[0]) && IS_STRING(operands[1])) {
+    ObjString* a = AS_STRING(operands[0]);
+    ObjString* b = AS_STRING(operands[1]);
+    ObjString* string = allocateString(a->length + b->length);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    result = OBJ_VAL(internString(string));
+  } else if (atStart && IS_NUMBER(operands[0]) && IS_NUMBER(operands[1])) {
+    result = NUMBER_VAL(AS_NUMBER(operands[0]) + AS_NUMBER(operands[1]));
+  } else {
+    return false;
+  }
+
+  dropConstants(2);
+  emitConstant(result);
+  return true;
+}
+
+// Returns whether the code from start to the end of the chunk is one
+// push that can neither fail nor run anything. Reading a global isn't,
+// since it fails when the global is undefined.
+static bool isPlainPush(int start) {
+  Chunk* chunk = currentChunk();
+  if (start >= chunk->count) return false;
+
+  switch (chunk->code[start]) {
+    case OpConstant:
+    case OpConstantLong:
+    case OpNil:
+    case OpTrue:
+    case OpFalse:
+    case OpGetLocal:
+      return start + instructionLength(chunk, start) == chunk->count;
+    default:
+      return false;
+  }
+}
+
+// Takes the length bytes at offset out of the chunk. Only the plain
+// push after them moves, so no jumps need fixing.
+static void removeCode(int offset, int length) {
+  Chunk* chunk = currentChunk();
+  int tail = chunk->count - offset - length;
+  memmove(chunk->code + offset, chunk->code + offset + length, tail);
+  memmove(chunk->lines + offset, chunk->lines + offset + length,
+          tail * sizeof(int));
+  chunk->count -= length;
+
+  if (current->foldableCount > 0) {
+    Foldable* last = &current->foldables[current->foldableCount - 1];
+    if (last->start >= offset) {
+      last->start -= length;
+      last->end -= length;
+    }
+  }
+}
+
+// Compiles the rest of a chain of '+' as one OpConcatN so that a
+// string built from several pieces is only allocated once. The values
+// so far are joined before each operand is compiled, in case it has
+// side effects or fails. When it turns out to be a plain push, the
+// join is taken back out and the operand joins the OpConcatN instead.
+static void addChain() {
+  int count = foldAdd(true) ? 1 : 2;
+  while (match(TokPlus)) {
+    if (count == UINT8_MAX) {
+      emitBytes(OpConcatN, (uint8_t)count);
+      count = 1;
+    }
+
+    int join = currentChunk()->count;
+    if (count == 2) {
+      emitByte(OpAdd);
+    } else if (count > 2) {
+      emitBytes(OpConcatN, (uint8_t)count);
+    }
+    int start = currentChunk()->count;
+
+    parsePrecedence(PrecFactor);
+    if (count > 1 && isPlainPush(start)) {
+      removeCode(join, start - join);
+      count++;
+    } else {
+      count = 2;
+    }
+    if (foldAdd(count == 2)) count--;
+  }
+
+  if (count == 2) {
+    emitByte(OpAdd);
+  } else if (count > 2) {
+    emitBytes(OpConcatN, (uint8_t)count);
+  }
+}
+
+// Computes a binary operator on constant operands, or returns false if
+// it has to wait until runtime, for instance to report a type error.
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value* result) {
+  switch (operatorType) {
+    case TokBangEq:
+      *result = BOOL_VAL(!valuesEqual(a, b));
+      return true;
+    case TokEqEq:
+      *result = BOOL_VAL(valuesEqual(a, b));
+      return true;
+    default:
+      break;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (operatorType) {
+    case TokMinus:     *result = NUMBER_VAL(x - y); break;
+    case TokStar:      *result = NUMBER_VAL(x * y); break;
+    case TokSlash:     *result = NUMBER_VAL(x / y); break;
+    case TokGreater:   *result = BOOL_VAL(x > y); break;
+    // These match OpGreaterEq and OpLessEq, which like the OpLess or
+    // OpGreater and OpNot pairs they come from differ from >= and <=
+    // for NaN.
+    case TokGreaterEq: *result = BOOL_VAL(!(x < y)); break;
+    case TokLess:      *result = BOOL_VAL(x < y); break;
+    case TokLessEq:    *result = BOOL_VAL(!(x > y)); break;
+    default: return false;
+  }
+  return true;
+}
+
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule* rule = getRule(operatorType);
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  Value operands[2];
+  Value result;
+  if (operatorType != TokPlus && tailConstants(2, operands) &&
+      foldBinary(operatorType, operands[0], operands[1], &result)) {
+    dropConstants(2);
+    emitConstant(result);
+    return;
+  }
+
   switch (operatorType) {
-    case TokPlus:          emitByte(OpAdd); break;
+    case TokPlus:          addChain(); break;
     case TokMinus:         emitByte(OpSubtract); break;
     case TokStar:          emitByte(OpMultiply); break;
     case TokSlash:         emitByte(OpDivide); break;
@@ -315,9 +1202,9 @@ static void binary(bool canAssign) {
 
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
-    case TokFalse: emitByte(OpFalse); break;
-    case TokNil: emitByte(OpNil); break;
-    case TokTrue: emitByte(OpTrue); break;
+    case TokFalse: emitConstant(BOOL_VAL(false)); break;
+    case TokNil: emitConstant(NIL_VAL); break;
+    case TokTrue: emitConstant(BOOL_VAL(true)); break;
     default: return; // Unreachable.
   }
 }
@@ -343,6 +1230,21 @@ static void unary(bool canAssign) {
   // Compile the operand.
   parsePrecedence(PrecUnary);
 
+  Value operand;
+  if (tailConstants(1, &operand)) {
+    if (operatorType == TokBang) {
+      dropConstants(1);
+      emitConstant(BOOL_VAL(isFalsey(operand)));
+      return;
+    }
+
+    if (operatorType == TokMinus && IS_NUMBER(operand)) {
+      dropConstants(1);
+      emitConstant(NUMBER_VAL(-AS_NUMBER(operand)));
+      return;
+    }
+  }
+
   // Emit the operator instruction.
   switch (operatorType) {
     case TokBang: emitByte(OpNot); break;
@@ -356,14 +1258,14 @@ static void print(bool canAssign) {
   emitByte(OpPrint);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
   consume(TokIdent, errorMessage);
 
 
   declareVariable();
   if (current->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return globalSlot(&parser.previous);
 }
 
 static void markInitialized() {
@@ -372,15 +1274,15 @@ static void markInitialized() {
       current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   if (current->scopeDepth > 0) {
     printf("local\n");
-    emitByte(OpCopyValToLocal);
+    // The value left on the stack is the local's slot.
     markInitialized();
     return;
   }
 
-  emitBytes(OpDefineGlobal, global);
+  emitIndexed(OpDefineGlobal, OpDefineGlobalLong, global);
 }
 
 static void and_(bool canAssign) {
@@ -404,7 +1306,7 @@ static void or_(bool canAssign) {
 }
 
 static void vardecl(bool canAssign) {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   if (match(TokEq)) {
     expression();
@@ -416,22 +1318,25 @@ static void vardecl(bool canAssign) {
 }
 
 static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
+  uint8_t getOp, setOp;
+  // Locals never need the long forms, so these are never emitted.
+  uint8_t getLongOp = OpGetGlobalLong, setLongOp = OpSetGlobalLong;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OpGetLocal;
     setOp = OpSetLocal;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalSlot(&name);
     getOp = OpGetGlobal;
     setOp = OpSetGlobal;
   }
   if (canAssign && match(TokEq)) {
     expression();
-    emitBytes(setOp, arg);
+    emitIndexed(setOp, setLongOp, arg);
   } else {
-    emitBytes(getOp, arg);
-  }}
+    emitIndexed(getOp, getLongOp, arg);
+  }
+}
 
 static void variable(bool canAssign) {
   namedVariable(parser.previous, canAssign);
@@ -441,26 +1346,82 @@ static void beginScope() {
   current->scopeDepth++;
 }
 
-static void endScope() {
-  current->scopeDepth--;
+// Turns the call just emitted, if the last instruction is one, into a
+// tail call. Only for calls whose result is returned right after.
+static void tailCall() {
+  if (current->lastCall != -1 &&
+      current->lastCall == currentChunk()->count - 2) {
+    currentChunk()->code[current->lastCall] = OpTailCall;
+  }
+}
 
+// Drops the scope's locals from the stack. With keepValue, the value
+// on top of them is the scope's result and is moved down into the
+// first local's slot to stay on the stack.
+static void endScope(bool keepValue) {
+  current->scopeDepth--;
 
+  int localCount = current->localCount;
   while (current->localCount > 0 &&
          current->locals[current->localCount - 1].depth >
             current->scopeDepth) {
-    emitByte(OpLocalPop);
     current->localCount--;
   }
+
+  int dropped = localCount - current->localCount;
+  if (dropped == 0) return;
+  if (keepValue) emitBytes(OpSetLocal, (uint8_t)current->localCount);
+  // Slot zero is never in a scope, so the count fits in a byte.
+  if (dropped == 1) {
+    emitByte(OpPop);
+  } else {
+    emitBytes(OpPopN, (uint8_t)dropped);
+  }
 }
 
-static void block(bool canAssign) {
-  beginScope();
-  while (!check(TokEnd) && !check(TokEOF)) {
+// Compiles expressions up to 'end' or 'else', leaving the value of the
+// last one, or nil if there are none. Each earlier value is popped
+// once the next expression starts, unless it declared a local, since
+// the value then is the local's slot.
+static void body() {
+  bool empty = true;
+  bool declared = false;
+  while (!check(TokEnd) && !check(TokElse) && !check(TokEOF)) {
+    if (!empty && !declared) emitByte(OpPop);
+
+    int localCount = current->localCount;
     expression();
+    declared = current->localCount > localCount;
+    empty = false;
+  }
+
+  if (empty) {
+    emitByte(OpNil);
+  } else if (declared) {
+    // Leave a copy on top so the local can be dropped under it.
+    emitBytes(OpGetLocal, (uint8_t)(current->localCount - 1));
   }
+}
+
+// Compiles the body of an if branch or a loop. Inside a function or a
+// block it gets a scope of its own; at the top level 'let' in it still
+// defines a global. Without keepValue the body's value is popped.
+static void branch(bool keepValue) {
+  bool scoped = current->scopeDepth > 0;
+  if (scoped) beginScope();
+
+  body();
+  if (!keepValue) emitByte(OpPop);
+
+  if (scoped) endScope(keepValue);
+}
+
+static void block(bool canAssign) {
+  beginScope();
+  body();
 
   consume(TokEnd, "Expect 'end' after block");
-  endScope();
+  endScope(true);
 }
 
 static void ifStmt(bool canAssign) {
@@ -468,36 +1429,53 @@ static void ifStmt(bool canAssign) {
   expression();
   consume(TokRightParen, "Expect ')' after condition");
 
+  Value condition;
+  bool constant = tailConstants(1, &condition);
+  int conditionStart = constant
+      ? current->foldables[current->foldableCount - 1].start : 0;
+  int localCount = current->localCount;
+  int widenings = current->widenings;
+
   int thenJump = emitJump(OpJumpIfFalse);
   emitByte(OpPop);
-  bool isElse;
-  while (!check(TokEnd) && !check(TokEOF)) {
-    expression();
-    if (match(TokElse)) {
-        isElse = true;
-        break;
-    }
-  }
+  int thenStart = currentChunk()->count;
+  branch(true);
+  bool isElse = match(TokElse);
 
+  int thenEnd = currentChunk()->count;
   int elseJump = emitJump(OpJump);
 
   patchJump(thenJump);
 
   emitByte(OpPop);
-  if (!isElse) {
+  int elseStart = currentChunk()->count;
+  if (isElse) {
+    branch(true);
+  } else {
     emitByte(OpNil);
   }
-  while (!check(TokEnd) && !check(TokEOF)) {
-    expression();
-  }
 
   patchJump(elseJump);
 
   consume(TokEnd, "expect 'end' after if");
+
+  // With a constant condition only one branch can run, so keep just
+  // that one. Branches that declare locals are left alone to keep the
+  // local slots in step with the compiler, as are ifs whose offsets
+  // moved when jumps were widened.
+  if (constant && current->localCount == localCount &&
+      current->widenings == widenings) {
+    if (isFalsey(condition)) {
+      keepCode(conditionStart, elseStart, currentChunk()->count);
+    } else {
+      keepCode(conditionStart, thenStart, thenEnd);
+    }
+  }
 }
 
 static void whileStmt(bool canAssign) {
   int loopStart = currentChunk()->count;
+  current->foldBarrier = loopStart;
 
   consume(TokLeftParen, "Expect '(' after 'while'");
   expression();
@@ -506,9 +1484,7 @@ static void whileStmt(bool canAssign) {
   int exitJump = emitJump(OpJumpIfFalse);
 
   emitByte(OpPop);
-  while (!check(TokEnd) && !check(TokEOF)) {
-    expression();
-  }
+  branch(false);
 
   emitLoop(loopStart);
 
@@ -533,26 +1509,26 @@ static void function(FunctionType type) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
 
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TokComma));
   }
   consume(TokRightParen, "Expect ')' after parameters.");
 
 
-  while (!check(TokEnd) && !check(TokEOF)) {
-    expression();
-  }
+  body();
+  tailCall();
   
   consume(TokEnd, "Expect 'end' after function");
   
-  endScope();
+  // The scope isn't ended since returning drops the whole frame.
   ObjFunction* function = endCompiler();
-  emitBytes(OpConstant, makeConstant(OBJ_VAL(function)));
+  emitIndexed(OpConstant, OpConstantLong,
+              makeConstant(OBJ_VAL(function)));
 }
 
 static void fn(bool canAssign) {
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   markInitialized();
   function(TypeFunction);
   defineVariable(global);
@@ -578,6 +1554,7 @@ static uint8_t argumentList() {
 
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OpCall, argCount);
 }
 
@@ -587,6 +1564,7 @@ static void ret(bool canAssign) {
   }
 
   expression();
+  tailCall();
   emitReturn();
 }
 
@@ -696,9 +1674,16 @@ ObjFunction* compile(const char* source) {
   parser.panicMode = false;
 
   advance();
-  while (!match(TokEOF)) {
-    expression();
-  }
+  body();
+  consume(TokEOF, "Expect expression.");
   ObjFunction* function = endCompiler();
   return parser.hadError ? NULL : function;
 }
+
+void markCompilerRoots() {
+  Compiler* compiler = current;
+  while (compiler != NULL) {
+    markObject((Obj*)compiler->function);
+    compiler = compiler->enclosing;
+  }
+}
@@ -20,6 +20,7 @@
 #include "object.h"
 
 ObjFunction* compile(const char* source);
+void markCompilerRoots();
 
 #endif
 
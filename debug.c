@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -25,6 +26,38 @@ static int constantInstruction(const char* name, Chunk* chunk,
   return offset + 2;
 }
 
+static int readLong(Chunk* chunk, int offset) {
+  return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+         chunk->code[offset + 2];
+}
+
+static int constantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+  int constant = readLong(chunk, offset + 1);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk,
+                             int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 2;
+}
+
+static int globalLongInstruction(const char* name, Chunk* chunk,
+                                 int offset) {
+  int slot = readLong(chunk, offset + 1);
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 4;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk,
                            int offset) {
   uint8_t slot = chunk->code[offset + 1];
@@ -41,6 +74,41 @@ static int jumpInstruction(const char* name, int sign,
   return offset + 3;
 }
 
+static int jumpLongInstruction(const char* name, int sign,
+                               Chunk* chunk, int offset) {
+  int jump = readLong(chunk, offset + 1);
+  printf("%-16s %4d -> %d\n", name, offset,
+         offset + 4 + sign * jump);
+  return offset + 4;
+}
+
+// Prints a superinstruction that reads a local and then a constant or
+// another local, followed by a jump if it has one.
+static int localOperandsInstruction(const char* name, Chunk* chunk,
+                                    int offset, bool constant,
+                                    bool jump) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t operand = chunk->code[offset + 2];
+  printf("%-16s %4d ", name, slot);
+  if (constant) {
+    printf("'");
+    printValue(chunk->constants.values[operand]);
+    printf("'");
+  } else {
+    printf("%d", operand);
+  }
+
+  if (!jump) {
+    printf("\n");
+    return offset + 3;
+  }
+
+  uint16_t distance = (uint16_t)(chunk->code[offset + 3] << 8);
+  distance |= chunk->code[offset + 4];
+  printf(" -> %d\n", offset + 5 + distance);
+  return offset + 5;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0 &&
@@ -56,6 +124,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OpRETURN", offset);
     case OpConstant:
       return constantInstruction("OpCONSTANT", chunk, offset);
+    case OpConstantLong:
+      return constantLongInstruction("OpConstantLong", chunk, offset);
     case OpNegate:
       return simpleInstruction("OpNEGATE", offset);
     case OpAdd:
@@ -80,36 +150,206 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OpGREATER", offset);
     case OpLess:
       return simpleInstruction("OpLESS", offset);
+    case OpNotEq:
+      return simpleInstruction("OpNotEq", offset);
+    case OpGreaterEq:
+      return simpleInstruction("OpGreaterEq", offset);
+    case OpLessEq:
+      return simpleInstruction("OpLessEq", offset);
     case OpPrint:
       return simpleInstruction("OpPrint", offset);
     case OpDefineGlobal:
-      return constantInstruction("OpDefineGlobal", chunk,
-                                 offset);
+      return globalInstruction("OpDefineGlobal", chunk, offset);
+    case OpDefineGlobalLong:
+      return globalLongInstruction("OpDefineGlobalLong", chunk, offset);
     case OpGetGlobal:
-      return constantInstruction("OpGetGlobal", chunk, offset);
+      return globalInstruction("OpGetGlobal", chunk, offset);
+    case OpGetGlobalLong:
+      return globalLongInstruction("OpGetGlobalLong", chunk, offset);
     case OpSetGlobal:
-      return constantInstruction("OpSetGlobal", chunk, offset);
+      return globalInstruction("OpSetGlobal", chunk, offset);
+    case OpSetGlobalLong:
+      return globalLongInstruction("OpSetGlobalLong", chunk, offset);
       return simpleInstruction("OpPOP", offset);
 
     case OpGetLocal:
       return byteInstruction("OpGET_LOCAL", chunk, offset);
+    case OpSetLocal:
+      return byteInstruction("OpSET_LOCAL", chunk, offset);
     
     case OpPop:
       return simpleInstruction("OpPop", offset);
-    case OpLocalPop:
-      return simpleInstruction("OpLocalPop", offset);
-    case OpCopyValToLocal:
-      return simpleInstruction("OpCopyValToLocal", offset);
+    case OpPopN:
+      return byteInstruction("OpPopN", chunk, offset);
     case OpJump:
       return jumpInstruction("OpJump", 1, chunk, offset);
+    case OpJumpLong:
+      return jumpLongInstruction("OpJumpLong", 1, chunk, offset);
     case OpJumpIfFalse:
       return jumpInstruction("OpJumpIfFalse", 1, chunk, offset);
+    case OpJumpIfFalseLong:
+      return jumpLongInstruction("OpJumpIfFalseLong", 1, chunk, offset);
     case OpLoop:
       return jumpInstruction("OpLoop", -1, chunk, offset);
+    case OpLoopLong:
+      return jumpLongInstruction("OpLoopLong", -1, chunk, offset);
    case OpCall:
       return byteInstruction("OpCall", chunk, offset);
+    case OpTailCall:
+      return byteInstruction("OpTailCall", chunk, offset);
+    case OpConcatN:
+      return byteInstruction("OpConcatN", chunk, offset);
+    case OpAddLocalConst:
+      return localOperandsInstruction("OpAddLocalConst", chunk, offset,
+                                      true, false);
+    case OpJumpIfFalsePop:
+      return jumpInstruction("OpJumpIfFalsePop", 1, chunk, offset);
+    case OpJumpIfNotLessLocalConst:
+      return localOperandsInstruction("OpJumpIfNotLessLocalConst", chunk,
+                                      offset, true, true);
+    case OpJumpIfNotLessLocalLocal:
+      return localOperandsInstruction("OpJumpIfNotLessLocalLocal", chunk,
+                                      offset, false, true);
+    case OpPrintPop:
+      return simpleInstruction("OpPrintPop", offset);
+    case OpAddNum:
+      return simpleInstruction("OpAddNum", offset);
+    case OpAddStr:
+      return simpleInstruction("OpAddStr", offset);
+    case OpEqNum:
+      return simpleInstruction("OpEqNum", offset);
+    case OpNotEqNum:
+      return simpleInstruction("OpNotEqNum", offset);
+    case OpAddLocalConstNum:
+      return localOperandsInstruction("OpAddLocalConstNum", chunk, offset,
+                                      true, false);
+    case OpAddNumUnchecked:
+      return simpleInstruction("OpAddNumUnchecked", offset);
+    case OpSubtractUnchecked:
+      return simpleInstruction("OpSubtractUnchecked", offset);
+    case OpMultiplyUnchecked:
+      return simpleInstruction("OpMultiplyUnchecked", offset);
+    case OpDivideUnchecked:
+      return simpleInstruction("OpDivideUnchecked", offset);
+    case OpNegateUnchecked:
+      return simpleInstruction("OpNegateUnchecked", offset);
+    case OpGreaterUnchecked:
+      return simpleInstruction("OpGreaterUnchecked", offset);
+    case OpLessUnchecked:
+      return simpleInstruction("OpLessUnchecked", offset);
+    case OpGreaterEqUnchecked:
+      return simpleInstruction("OpGreaterEqUnchecked", offset);
+    case OpLessEqUnchecked:
+      return simpleInstruction("OpLessEqUnchecked", offset);
+    case OpAddLocalConstUnchecked:
+      return localOperandsInstruction("OpAddLocalConstUnchecked", chunk,
+                                      offset, true, false);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
+
+#ifdef DEBUG_PROFILE_PAIRS
+static const char* opcodeNames[] = {
+  [OpReturn] = "OpReturn",
+  [OpConstant] = "OpConstant",
+  [OpConstantLong] = "OpConstantLong",
+  [OpNegate] = "OpNegate",
+  [OpAdd] = "OpAdd",
+  [OpSubtract] = "OpSubtract",
+  [OpMultiply] = "OpMultiply",
+  [OpDivide] = "OpDivide",
+  [OpNil] = "OpNil",
+  [OpFalse] = "OpFalse",
+  [OpTrue] = "OpTrue",
+  [OpNot] = "OpNot",
+  [OpEq] = "OpEq",
+  [OpGreater] = "OpGreater",
+  [OpLess] = "OpLess",
+  [OpNotEq] = "OpNotEq",
+  [OpGreaterEq] = "OpGreaterEq",
+  [OpLessEq] = "OpLessEq",
+  [OpPrint] = "OpPrint",
+  [OpDefineGlobal] = "OpDefineGlobal",
+  [OpDefineGlobalLong] = "OpDefineGlobalLong",
+  [OpGetGlobal] = "OpGetGlobal",
+  [OpGetGlobalLong] = "OpGetGlobalLong",
+  [OpSetGlobal] = "OpSetGlobal",
+  [OpSetGlobalLong] = "OpSetGlobalLong",
+  [OpGetLocal] = "OpGetLocal",
+  [OpSetLocal] = "OpSetLocal",
+  [OpPop] = "OpPop",
+  [OpPopN] = "OpPopN",
+  [OpJumpIfFalse] = "OpJumpIfFalse",
+  [OpJumpIfFalseLong] = "OpJumpIfFalseLong",
+  [OpJump] = "OpJump",
+  [OpJumpLong] = "OpJumpLong",
+  [OpLoop] = "OpLoop",
+  [OpLoopLong] = "OpLoopLong",
+  [OpCall] = "OpCall",
+  [OpTailCall] = "OpTailCall",
+  [OpConcatN] = "OpConcatN",
+  [OpAddLocalConst] = "OpAddLocalConst",
+  [OpJumpIfFalsePop] = "OpJumpIfFalsePop",
+  [OpJumpIfNotLessLocalConst] = "OpJumpIfNotLessLocalConst",
+  [OpJumpIfNotLessLocalLocal] = "OpJumpIfNotLessLocalLocal",
+  [OpPrintPop] = "OpPrintPop",
+  [OpAddNum] = "OpAddNum",
+  [OpAddStr] = "OpAddStr",
+  [OpEqNum] = "OpEqNum",
+  [OpNotEqNum] = "OpNotEqNum",
+  [OpAddLocalConstNum] = "OpAddLocalConstNum",
+  [OpAddNumUnchecked] = "OpAddNumUnchecked",
+  [OpSubtractUnchecked] = "OpSubtractUnchecked",
+  [OpMultiplyUnchecked] = "OpMultiplyUnchecked",
+  [OpDivideUnchecked] = "OpDivideUnchecked",
+  [OpNegateUnchecked] = "OpNegateUnchecked",
+  [OpGreaterUnchecked] = "OpGreaterUnchecked",
+  [OpLessUnchecked] = "OpLessUnchecked",
+  [OpGreaterEqUnchecked] = "OpGreaterEqUnchecked",
+  [OpLessEqUnchecked] = "OpLessEqUnchecked",
+  [OpAddLocalConstUnchecked] = "OpAddLocalConstUnchecked",
+};
+
+#define PROFILE_SIZE (sizeof(opcodeNames) / sizeof(opcodeNames[0]))
+#define PROFILE_TOP 20
+
+static uint64_t pairCounts[PROFILE_SIZE][PROFILE_SIZE];
+static uint8_t previousInstruction = OpReturn;
+
+void profilePair(uint8_t instruction) {
+  pairCounts[previousInstruction][instruction]++;
+  previousInstruction = instruction;
+}
+
+void printPairProfile() {
+  uint64_t total = 0;
+  for (size_t i = 0; i < PROFILE_SIZE; i++) {
+    for (size_t j = 0; j < PROFILE_SIZE; j++) total += pairCounts[i][j];
+  }
+  if (total == 0) return;
+
+  fprintf(stderr, "== instruction pairs ==\n");
+  for (int rank = 0; rank < PROFILE_TOP; rank++) {
+    size_t first = 0;
+    size_t second = 0;
+    for (size_t i = 0; i < PROFILE_SIZE; i++) {
+      for (size_t j = 0; j < PROFILE_SIZE; j++) {
+        if (pairCounts[i][j] > pairCounts[first][second]) {
+          first = i;
+          second = j;
+        }
+      }
+    }
+
+    uint64_t count = pairCounts[first][second];
+    if (count == 0) break;
+    fprintf(stderr, "%-20s %-20s %12llu %5.1f%%\n", opcodeNames[first],
+            opcodeNames[second], (unsigned long long)count,
+            100.0 * count / total);
+    // Each pair is only reported once.
+    pairCounts[first][second] = 0;
+  }
+}
+#endif
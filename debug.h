@@ -6,4 +6,11 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+#ifdef DEBUG_PROFILE_PAIRS
+// Counts how often each instruction runs right after the one before,
+// and prints the most frequent pairs.
+void profilePair(uint8_t instruction);
+void printPairProfile();
+#endif
+
 #endif
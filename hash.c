@@ -0,0 +1,145 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+// A wyhash-style hash: the input is read eight bytes at a time and
+// mixed with 64x64->128 bit multiplies. The seed is chosen per process
+// so that which strings collide can't be worked out ahead of time.
+
+static const uint64_t secret[4] = {
+  0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+  0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static uint64_t seed = 0;
+
+// Multiplies a and b and returns the high and low halves of the
+// product in a and b.
+static inline void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+#else
+  uint64_t aHigh = *a >> 32, aLow = (uint32_t)*a;
+  uint64_t bHigh = *b >> 32, bLow = (uint32_t)*b;
+  uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow;
+  uint64_t middle1 = aLow * bHigh, low = aLow * bLow;
+  uint64_t t = low + (middle0 << 32);
+  uint64_t carry = t < low;
+  uint64_t lo = t + (middle1 << 32);
+  carry += lo < t;
+  *a = lo;
+  *b = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  multiply(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Reads one to three bytes.
+static inline uint64_t readSmall(const uint8_t* p, size_t length) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+         p[length - 1];
+}
+
+void initHashSeed() {
+  uint64_t random = 0;
+  FILE* file = fopen("/dev/urandom", "rb");
+  if (file != NULL) {
+    if (fread(&random, sizeof(random), 1, file) != 1) random = 0;
+    fclose(file);
+  }
+
+  // Fall back on whatever differs between runs.
+  if (random == 0) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    random = mix((uint64_t)now.tv_sec ^ secret[2],
+                 (uint64_t)now.tv_nsec ^ (uint64_t)(uintptr_t)&now);
+  }
+
+  // Scrambled once here rather than on every call.
+  seed = random ^ mix(random ^ secret[0], secret[1]);
+}
+
+uint32_t hashString(const char* key, int length) {
+  const uint8_t* p = (const uint8_t*)key;
+  size_t remaining = (size_t)length;
+  uint64_t state = seed;
+  uint64_t a, b;
+
+  if (remaining <= 16) {
+    if (remaining >= 4) {
+      // Two overlapping pairs of 4-byte reads cover 4 to 16 bytes.
+      size_t offset = (remaining >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + offset);
+      b = (read32(p + remaining - 4) << 32) |
+          read32(p + remaining - 4 - offset);
+    } else if (remaining > 0) {
+      a = readSmall(p, remaining);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (remaining > 48) {
+      // Three independent lanes keep the multipliers busy.
+      uint64_t lane1 = state, lane2 = state;
+      do {
+        state = mix(read64(p) ^ secret[1], read64(p + 8) ^ state);
+        lane1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ lane1);
+        lane2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ lane2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      state ^= lane1 ^ lane2;
+    }
+
+    while (remaining > 16) {
+      state = mix(read64(p) ^ secret[1], read64(p + 8) ^ state);
+      p += 16;
+      remaining -= 16;
+    }
+
+    // The last 16 bytes, which may overlap the ones already mixed.
+    a = read64(p + remaining - 16);
+    b = read64(p + remaining - 8);
+  }
+
+  a ^= secret[1];
+  b ^= state;
+  multiply(&a, &b);
+  return (uint32_t)mix(a ^ secret[0] ^ (uint64_t)length, b ^ secret[1]);
+}
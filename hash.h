@@ -0,0 +1,26 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#ifndef mti_hash_h
+#define mti_hash_h
+
+#include "common.h"
+
+// Picks a fresh random seed for hashString(). Must run before the first
+// string is hashed, since hashes are cached in the strings.
+void initHashSeed();
+uint32_t hashString(const char* key, int length);
+
+#endif
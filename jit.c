@@ -0,0 +1,1676 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT
+
+// General purpose registers by their encoding.
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+
+// The low byte registers, for setcc.
+#define AL 0
+#define CL 1
+#define DL 2
+
+// While the code runs these hold the stack top, the frame's slots, the
+// frame and the function's constants. All of them are callee-saved, so
+// to C the code is an ordinary function.
+#define STACK RBX
+#define SLOTS R12
+#define FRAME R13
+#define CONSTANTS R14
+
+// Opcodes of the register to register forms.
+#define MOV 0x89
+#define AND 0x21
+#define OR  0x09
+#define XOR 0x31
+#define CMP 0x39
+
+// Scalar double opcodes.
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+
+// Condition codes for jcc and setcc. JMP stands for no condition.
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_P  0xa
+#define CC_NP 0xb
+#define JMP   -1
+
+// A rel32 field that is filled in once all the code is laid out. It
+// jumps either to the code for the instruction at target, or to a stub
+// that leaves to the interpreter there.
+typedef struct {
+  int at;
+  int target;
+  bool exit;
+} Patch;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+  Patch* patches;
+  int patchCount;
+  int patchCapacity;
+} Assembler;
+
+typedef Value* (*JitEntry)(CallFrame* frame, Value* stackTop,
+                           uint8_t* start);
+
+static void emitByte(Assembler* as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    int oldCapacity = as->capacity;
+    as->capacity = GROW_CAPACITY(oldCapacity);
+    as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+// REX prefix for a 64-bit operation between reg and rm.
+static void rex(Assembler* as, int reg, int rm) {
+  emitByte(as, 0x48 | (reg >= 8 ? 0x4 : 0) | (rm >= 8 ? 0x1 : 0));
+}
+
+// op between reg and [base + disp].
+static void memory(Assembler* as, uint8_t op, int reg, int base,
+                   int32_t disp) {
+  rex(as, reg, base);
+  emitByte(as, op);
+  emitByte(as, 0x80 | (reg & 7) << 3 | (base & 7));
+  // RSP and R12 as a base need a SIB byte.
+  if ((base & 7) == 4) emitByte(as, 0x24);
+  emit32(as, (uint32_t)disp);
+}
+
+static void load(Assembler* as, int reg, int base, int32_t disp) {
+  memory(as, 0x8b, reg, base, disp);
+}
+
+static void store(Assembler* as, int base, int32_t disp, int reg) {
+  memory(as, 0x89, reg, base, disp);
+}
+
+// op dst, src.
+static void registers(Assembler* as, uint8_t op, int dst, int src) {
+  rex(as, src, dst);
+  emitByte(as, op);
+  emitByte(as, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+// op dst, src on the low bytes of the first four registers.
+static void bytes(Assembler* as, uint8_t op, int dst, int src) {
+  emitByte(as, op);
+  emitByte(as, 0xc0 | src << 3 | dst);
+}
+
+static void moveImmediate(Assembler* as, int reg, uint64_t value) {
+  rex(as, 0, reg);
+  emitByte(as, 0xb8 | (reg & 7));
+  emit64(as, value);
+}
+
+static void addImmediate(Assembler* as, int reg, int32_t value) {
+  rex(as, 0, reg);
+  emitByte(as, 0x81);
+  emitByte(as, 0xc0 | (reg & 7));
+  emit32(as, (uint32_t)value);
+}
+
+static void toXmm(Assembler* as, int xmm, int reg) {
+  emitByte(as, 0x66);
+  rex(as, xmm, reg);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x6e);
+  emitByte(as, 0xc0 | (xmm & 7) << 3 | (reg & 7));
+}
+
+static void fromXmm(Assembler* as, int reg, int xmm) {
+  emitByte(as, 0x66);
+  rex(as, xmm, reg);
+  emitByte(as, 0x0f);
+  emitByte(as, 0x7e);
+  emitByte(as, 0xc0 | (xmm & 7) << 3 | (reg & 7));
+}
+
+// op dst, src on two xmm registers, after prefix if it isn't zero.
+static void xmmRegisters(Assembler* as, uint8_t prefix, uint8_t op,
+                         int dst, int src) {
+  if (prefix != 0) emitByte(as, prefix);
+  if (dst >= 8 || src >= 8) {
+    emitByte(as, 0x40 | (dst >= 8 ? 0x4 : 0) | (src >= 8 ? 0x1 : 0));
+  }
+  emitByte(as, 0x0f);
+  emitByte(as, op);
+  emitByte(as, 0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+// dst = dst op src.
+static void scalar(Assembler* as, uint8_t op, int dst, int src) {
+  xmmRegisters(as, 0xf2, op, dst, src);
+}
+
+static void moveXmm(Assembler* as, int dst, int src) {
+  xmmRegisters(as, 0xf2, 0x10, dst, src);
+}
+
+// Sets the flags from comparing xmm a with xmm b. Unordered operands
+// set ZF, PF and CF.
+static void ucomisd(Assembler* as, int a, int b) {
+  xmmRegisters(as, 0x66, 0x2e, a, b);
+}
+
+static void setcc(Assembler* as, int cc, int reg) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0x90 | cc);
+  emitByte(as, 0xc0 | reg);
+}
+
+static void jumpTo(Assembler* as, int cc, int target, bool exit) {
+  if (cc == JMP) {
+    emitByte(as, 0xe9);
+  } else {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 | cc);
+  }
+
+  if (as->patchCapacity < as->patchCount + 1) {
+    int oldCapacity = as->patchCapacity;
+    as->patchCapacity = GROW_CAPACITY(oldCapacity);
+    as->patches = GROW_ARRAY(Patch, as->patches, oldCapacity,
+                             as->patchCapacity);
+  }
+  as->patches[as->patchCount++] = (Patch){as->count, target, exit};
+  emit32(as, 0);
+}
+
+// Leaves the instruction at offset to the interpreter.
+static void exitAt(Assembler* as, int offset) {
+  jumpTo(as, JMP, offset, true);
+}
+
+static void pushRegister(Assembler* as, int reg) {
+  store(as, STACK, 0, reg);
+  addImmediate(as, STACK, sizeof(Value));
+}
+
+// Where the value distance below the top of the stack is.
+static int32_t peek(int distance) {
+  return -(int32_t)sizeof(Value) * (distance + 1);
+}
+
+static void loadConstant(Assembler* as, int reg, Chunk* chunk,
+                         int index) {
+  Value value = chunk->constants.values[index];
+  // Objects are loaded from the constant table since the collector
+  // may move them.
+  if (IS_OBJ(value)) {
+    load(as, reg, CONSTANTS, index * (int32_t)sizeof(Value));
+  } else {
+    moveImmediate(as, reg, value);
+  }
+}
+
+// Leaves to the interpreter at offset unless a, and b if it isn't -1,
+// hold numbers. Clobbers RDX and RSI.
+static void guardNumbers(Assembler* as, int a, int b, int offset) {
+  moveImmediate(as, RDX, QNAN);
+  for (int i = 0; i < 2; i++) {
+    int reg = i == 0 ? a : b;
+    if (reg == -1) break;
+    registers(as, MOV, RSI, reg);
+    registers(as, AND, RSI, RDX);
+    registers(as, CMP, RSI, RDX);
+    jumpTo(as, CC_E, offset, true);
+  }
+}
+
+// Loads the top two values into xmm0 and xmm1 once both are numbers.
+// Unchecked instructions already know they are.
+static void loadOperands(Assembler* as, int offset, bool checked) {
+  load(as, RAX, STACK, peek(1));
+  load(as, RCX, STACK, peek(0));
+  if (checked) guardNumbers(as, RAX, RCX, offset);
+  toXmm(as, 0, RAX);
+  toXmm(as, 1, RCX);
+}
+
+// Replaces the operands on top of the stack with the boolean in AL.
+static void booleanResult(Assembler* as, int operands) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0xb6);
+  emitByte(as, 0xc0);
+  moveImmediate(as, RCX, FALSE_VAL);
+  registers(as, OR, RAX, RCX);
+  store(as, STACK, peek(operands - 1), RAX);
+  addImmediate(as, STACK, -(int32_t)sizeof(Value) * (operands - 1));
+}
+
+static void arithmetic(Assembler* as, int offset, uint8_t op,
+                       bool checked) {
+  loadOperands(as, offset, checked);
+  scalar(as, op, 0, 1);
+  fromXmm(as, RAX, 0);
+  store(as, STACK, peek(1), RAX);
+  addImmediate(as, STACK, -(int32_t)sizeof(Value));
+}
+
+// Sets AL to whether the numbers in xmm a and xmm b compare true.
+// Like the interpreter, OpGreaterEq and OpLessEq are the negation of
+// OpLess and OpGreater, so NaN makes them true. Clobbers CL.
+static void compareXmm(Assembler* as, uint8_t instruction, int a, int b) {
+  switch (instruction) {
+    case OpLess:
+      ucomisd(as, b, a);
+      setcc(as, CC_A, AL);
+      break;
+    case OpGreater:
+      ucomisd(as, a, b);
+      setcc(as, CC_A, AL);
+      break;
+    case OpGreaterEq:
+      ucomisd(as, b, a);
+      setcc(as, CC_BE, AL);
+      break;
+    case OpLessEq:
+      ucomisd(as, a, b);
+      setcc(as, CC_BE, AL);
+      break;
+    case OpEq:
+    case OpEqNum:
+      ucomisd(as, a, b);
+      setcc(as, CC_E, AL);
+      setcc(as, CC_NP, CL);
+      bytes(as, 0x20, AL, CL);
+      break;
+    case OpNotEq:
+    case OpNotEqNum:
+      ucomisd(as, a, b);
+      setcc(as, CC_NE, AL);
+      setcc(as, CC_P, CL);
+      bytes(as, 0x08, AL, CL);
+      break;
+  }
+}
+
+static void comparison(Assembler* as, int offset, uint8_t instruction) {
+  bool checked = checkedInstruction(instruction) == instruction;
+  loadOperands(as, offset, checked);
+  compareXmm(as, checkedInstruction(instruction), 0, 1);
+  booleanResult(as, 2);
+}
+
+// Jumps to target when reg holds nil or false. Clobbers RCX.
+static void jumpIfFalsey(Assembler* as, int reg, int target) {
+  moveImmediate(as, RCX, NIL_VAL);
+  registers(as, CMP, reg, RCX);
+  jumpTo(as, CC_E, target, false);
+  moveImmediate(as, RCX, FALSE_VAL);
+  registers(as, CMP, reg, RCX);
+  jumpTo(as, CC_E, target, false);
+}
+
+// Jumps to target unless the local in slot is less than operand, a
+// constant or another local.
+static void jumpIfNotLess(Assembler* as, Chunk* chunk, int offset,
+                          bool constant) {
+  uint8_t* code = chunk->code + offset;
+  if (constant && !IS_NUMBER(chunk->constants.values[code[2]])) {
+    exitAt(as, offset);
+    return;
+  }
+
+  load(as, RAX, SLOTS, code[1] * (int32_t)sizeof(Value));
+  if (constant) {
+    loadConstant(as, RCX, chunk, code[2]);
+    guardNumbers(as, RAX, -1, offset);
+  } else {
+    load(as, RCX, SLOTS, code[2] * (int32_t)sizeof(Value));
+    guardNumbers(as, RAX, RCX, offset);
+  }
+  toXmm(as, 0, RAX);
+  toXmm(as, 1, RCX);
+  ucomisd(as, 1, 0);
+  jumpTo(as, CC_BE, jumpTarget(chunk, offset), false);
+}
+
+static void addLocalConstant(Assembler* as, Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code + offset;
+  if (!IS_NUMBER(chunk->constants.values[code[2]])) {
+    exitAt(as, offset);
+    return;
+  }
+
+  load(as, RAX, SLOTS, code[1] * (int32_t)sizeof(Value));
+  if (code[0] != OpAddLocalConstUnchecked) {
+    guardNumbers(as, RAX, -1, offset);
+  }
+  toXmm(as, 0, RAX);
+  loadConstant(as, RCX, chunk, code[2]);
+  toXmm(as, 1, RCX);
+  scalar(as, ADDSD, 0, 1);
+  fromXmm(as, RAX, 0);
+  pushRegister(as, RAX);
+}
+
+// Sums count numbers in the order the interpreter does. Anything else
+// is left to it, before the stack is touched.
+static void concatNumbers(Assembler* as, int offset, int count) {
+  load(as, RAX, STACK, peek(count - 1));
+  guardNumbers(as, RAX, -1, offset);
+  for (int i = count - 2; i >= 0; i--) {
+    load(as, RAX, STACK, peek(i));
+    guardNumbers(as, RAX, -1, offset);
+  }
+
+  load(as, RAX, STACK, peek(count - 1));
+  toXmm(as, 0, RAX);
+  for (int i = count - 2; i >= 0; i--) {
+    load(as, RAX, STACK, peek(i));
+    toXmm(as, 1, RAX);
+    scalar(as, ADDSD, 0, 1);
+  }
+  fromXmm(as, RAX, 0);
+  store(as, STACK, peek(count - 1), RAX);
+  addImmediate(as, STACK, -(int32_t)sizeof(Value) * (count - 1));
+}
+
+// Loads the address of the global values into RAX. The array can grow
+// when more code is compiled, so it is read each time.
+static void loadGlobals(Assembler* as) {
+  moveImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  load(as, RAX, RAX, 0);
+}
+
+static void globalAccess(Assembler* as, uint8_t instruction, int slot,
+                         int offset) {
+  int32_t at = slot * (int32_t)sizeof(Value);
+  loadGlobals(as);
+  switch (instruction) {
+    case OpDefineGlobal:
+      load(as, RCX, STACK, peek(0));
+      store(as, RAX, at, RCX);
+      break;
+    case OpGetGlobal:
+      load(as, RCX, RAX, at);
+      moveImmediate(as, RDX, UNDEFINED_VAL);
+      registers(as, CMP, RCX, RDX);
+      jumpTo(as, CC_E, offset, true);
+      pushRegister(as, RCX);
+      break;
+    case OpSetGlobal:
+      load(as, RCX, RAX, at);
+      moveImmediate(as, RDX, UNDEFINED_VAL);
+      registers(as, CMP, RCX, RDX);
+      jumpTo(as, CC_E, offset, true);
+      load(as, RCX, STACK, peek(0));
+      store(as, RAX, at, RCX);
+      break;
+  }
+}
+
+static int readLong(uint8_t* operand) {
+  return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+static void compileInstruction(Assembler* as, Chunk* chunk, int offset) {
+  uint8_t* code = chunk->code + offset;
+  switch (code[0]) {
+    case OpConstant:
+      loadConstant(as, RAX, chunk, code[1]);
+      pushRegister(as, RAX);
+      break;
+    case OpConstantLong:
+      loadConstant(as, RAX, chunk, readLong(code + 1));
+      pushRegister(as, RAX);
+      break;
+    case OpNil:
+      moveImmediate(as, RAX, NIL_VAL);
+      pushRegister(as, RAX);
+      break;
+    case OpTrue:
+      moveImmediate(as, RAX, TRUE_VAL);
+      pushRegister(as, RAX);
+      break;
+    case OpFalse:
+      moveImmediate(as, RAX, FALSE_VAL);
+      pushRegister(as, RAX);
+      break;
+    case OpNegate:
+    case OpNegateUnchecked:
+      load(as, RAX, STACK, peek(0));
+      if (code[0] == OpNegate) guardNumbers(as, RAX, -1, offset);
+      moveImmediate(as, RCX, SIGN_BIT);
+      registers(as, XOR, RAX, RCX);
+      store(as, STACK, peek(0), RAX);
+      break;
+    // Strings are left to the interpreter.
+    case OpAdd:
+    case OpAddNum:
+    case OpAddStr:
+      arithmetic(as, offset, ADDSD, true);
+      break;
+    case OpSubtract: arithmetic(as, offset, SUBSD, true); break;
+    case OpMultiply: arithmetic(as, offset, MULSD, true); break;
+    case OpDivide: arithmetic(as, offset, DIVSD, true); break;
+    case OpAddNumUnchecked: arithmetic(as, offset, ADDSD, false); break;
+    case OpSubtractUnchecked: arithmetic(as, offset, SUBSD, false); break;
+    case OpMultiplyUnchecked: arithmetic(as, offset, MULSD, false); break;
+    case OpDivideUnchecked: arithmetic(as, offset, DIVSD, false); break;
+    case OpNot:
+      load(as, RAX, STACK, peek(0));
+      moveImmediate(as, RCX, NIL_VAL);
+      registers(as, CMP, RAX, RCX);
+      setcc(as, CC_E, DL);
+      moveImmediate(as, RCX, FALSE_VAL);
+      registers(as, CMP, RAX, RCX);
+      setcc(as, CC_E, AL);
+      bytes(as, 0x08, AL, DL);
+      booleanResult(as, 1);
+      break;
+    case OpEq:
+    case OpEqNum:
+    case OpNotEq:
+    case OpNotEqNum:
+    case OpGreater:
+    case OpLess:
+    case OpGreaterEq:
+    case OpLessEq:
+    case OpGreaterUnchecked:
+    case OpLessUnchecked:
+    case OpGreaterEqUnchecked:
+    case OpLessEqUnchecked:
+      comparison(as, offset, code[0]);
+      break;
+    case OpDefineGlobal:
+    case OpGetGlobal:
+    case OpSetGlobal:
+      globalAccess(as, code[0], code[1], offset);
+      break;
+    case OpDefineGlobalLong:
+      globalAccess(as, OpDefineGlobal, readLong(code + 1), offset);
+      break;
+    case OpGetGlobalLong:
+      globalAccess(as, OpGetGlobal, readLong(code + 1), offset);
+      break;
+    case OpSetGlobalLong:
+      globalAccess(as, OpSetGlobal, readLong(code + 1), offset);
+      break;
+    case OpGetLocal:
+      load(as, RAX, SLOTS, code[1] * (int32_t)sizeof(Value));
+      pushRegister(as, RAX);
+      break;
+    case OpSetLocal:
+      load(as, RAX, STACK, peek(0));
+      store(as, SLOTS, code[1] * (int32_t)sizeof(Value), RAX);
+      break;
+    case OpPop:
+      addImmediate(as, STACK, -(int32_t)sizeof(Value));
+      break;
+    case OpPopN:
+      addImmediate(as, STACK, -(int32_t)sizeof(Value) * code[1]);
+      break;
+    case OpJumpIfFalse:
+    case OpJumpIfFalseLong:
+      load(as, RAX, STACK, peek(0));
+      jumpIfFalsey(as, RAX, jumpTarget(chunk, offset));
+      break;
+    case OpJumpIfFalsePop:
+      load(as, RAX, STACK, peek(0));
+      jumpIfFalsey(as, RAX, jumpTarget(chunk, offset));
+      addImmediate(as, STACK, -(int32_t)sizeof(Value));
+      break;
+    case OpJump:
+    case OpJumpLong:
+    case OpLoop:
+    case OpLoopLong:
+      jumpTo(as, JMP, jumpTarget(chunk, offset), false);
+      break;
+    case OpConcatN:
+      concatNumbers(as, offset, code[1]);
+      break;
+    case OpAddLocalConst:
+    case OpAddLocalConstNum:
+    case OpAddLocalConstUnchecked:
+      addLocalConstant(as, chunk, offset);
+      break;
+    case OpJumpIfNotLessLocalConst:
+      jumpIfNotLess(as, chunk, offset, true);
+      break;
+    case OpJumpIfNotLessLocalLocal:
+      jumpIfNotLess(as, chunk, offset, false);
+      break;
+    // Calls and returns change frames, which only the interpreter
+    // does. Everything else without a template goes there too.
+    default:
+      exitAt(as, offset);
+      break;
+  }
+}
+
+// Pushes RBX, R12, R13 and R14.
+static void saveRegisters(Assembler* as) {
+  emitByte(as, 0x53);
+  emitByte(as, 0x41);
+  emitByte(as, 0x54);
+  emitByte(as, 0x41);
+  emitByte(as, 0x55);
+  emitByte(as, 0x41);
+  emitByte(as, 0x56);
+}
+
+// Pops what saveRegisters() pushed and returns.
+static void restoreRegisters(Assembler* as) {
+  emitByte(as, 0x41);
+  emitByte(as, 0x5e);
+  emitByte(as, 0x41);
+  emitByte(as, 0x5d);
+  emitByte(as, 0x41);
+  emitByte(as, 0x5c);
+  emitByte(as, 0x5b);
+  emitByte(as, 0xc3);
+}
+
+// Saves the registers the code uses and jumps to the instruction
+// passed in RDX.
+static void prologue(Assembler* as) {
+  saveRegisters(as);
+  registers(as, MOV, FRAME, RDI);
+  registers(as, MOV, STACK, RSI);
+  load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+  load(as, RAX, FRAME, offsetof(CallFrame, function));
+  load(as, CONSTANTS, RAX,
+       offsetof(ObjFunction, chunk.constants.values));
+
+  emitByte(as, 0xff);
+  emitByte(as, 0xe2);
+}
+
+// Stores the instruction pointer in RAX to the frame and returns the
+// stack top.
+static void epilogue(Assembler* as) {
+  store(as, FRAME, offsetof(CallFrame, ip), RAX);
+  registers(as, MOV, RAX, STACK);
+  restoreRegisters(as);
+}
+
+// Copies the assembled code into memory it can run from, or returns
+// NULL if there isn't any.
+static uint8_t* installCode(Assembler* as) {
+  uint8_t* code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) return NULL;
+
+  memcpy(code, as->code, as->count);
+  if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, as->count);
+    return NULL;
+  }
+  return code;
+}
+
+void jitCompile(ObjFunction* function) {
+#ifdef AOT
+  // Functions loaded from a shared object are native code already.
+  if (function->aot != NULL) return;
+#endif
+
+  // Loops that already run as traces are faster left to them.
+  for (Trace* trace = function->traces; trace != NULL;
+       trace = trace->next) {
+    if (trace->code != NULL) return;
+  }
+
+  Chunk* chunk = &function->chunk;
+  Assembler as = {NULL, 0, 0, NULL, 0, 0};
+  uint32_t* entries = ALLOCATE(uint32_t, chunk->count);
+  int* exits = ALLOCATE(int, chunk->count);
+
+  prologue(&as);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    entries[offset] = (uint32_t)as.count;
+    exits[offset] = -1;
+    compileInstruction(&as, chunk, offset);
+  }
+
+  int exit = as.count;
+  epilogue(&as);
+
+  // One stub per instruction that is left to the interpreter.
+  for (int i = 0; i < as.patchCount; i++) {
+    Patch* patch = &as.patches[i];
+    if (!patch->exit || exits[patch->target] != -1) continue;
+
+    exits[patch->target] = as.count;
+    moveImmediate(&as, RAX, (uint64_t)(uintptr_t)(chunk->code +
+                                                   patch->target));
+    emitByte(&as, 0xe9);
+    emit32(&as, (uint32_t)(exit - (as.count + 4)));
+  }
+
+  for (int i = 0; i < as.patchCount; i++) {
+    Patch* patch = &as.patches[i];
+    int target = patch->exit ? exits[patch->target]
+                             : (int)entries[patch->target];
+    uint32_t distance = (uint32_t)(target - (patch->at + 4));
+    memcpy(as.code + patch->at, &distance, sizeof(distance));
+  }
+
+  uint8_t* code = installCode(&as);
+  if (code != NULL) {
+    JitCode* jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    jit->size = as.count;
+    jit->entries = entries;
+    jit->entryCount = chunk->count;
+    function->jit = jit;
+    entries = NULL;
+  }
+
+  // Without machine code the function just stays interpreted.
+  if (entries != NULL) FREE_ARRAY(uint32_t, entries, chunk->count);
+  FREE_ARRAY(int, exits, chunk->count);
+  FREE_ARRAY(uint8_t, as.code, as.capacity);
+  FREE_ARRAY(Patch, as.patches, as.patchCapacity);
+}
+
+void jitFree(ObjFunction* function) {
+  Trace* trace = function->traces;
+  while (trace != NULL) {
+    Trace* next = trace->next;
+    if (trace->code != NULL) munmap(trace->code, trace->size);
+    FREE(Trace, trace);
+    trace = next;
+  }
+  function->traces = NULL;
+
+  JitCode* jit = function->jit;
+  if (jit == NULL) return;
+
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(uint32_t, jit->entries, jit->entryCount);
+  FREE(JitCode, jit);
+  function->jit = NULL;
+}
+
+void jitRun(CallFrame* frame) {
+  JitCode* jit = frame->function->jit;
+  int offset = (int)(frame->ip - frame->function->chunk.code);
+  JitEntry entry = (JitEntry)(void*)jit->code;
+  vm.stackTop = entry(frame, vm.stackTop, jit->code + jit->entries[offset]);
+}
+
+// A loop is traced by running its next iteration on copies of the
+// values it touches, noting each instruction and which way each branch
+// goes. That path is compiled into straight-line code that jumps back
+// to its own start. The locals and globals the loop uses are checked
+// to be numbers once, on the way in, and kept in xmm registers. A
+// branch that goes the other way, or arithmetic that makes a NaN,
+// leaves through a stub that writes them and the stack back.
+
+// The longest trace, the deepest its stack gets, and the most locals
+// and globals it can keep in registers.
+#define TRACE_MAX 256
+#define TRACE_STACK 16
+#define TRACE_VARIABLES 8
+
+// While a trace runs R14 holds the global values instead of the
+// constants.
+#define GLOBALS R14
+
+// xmm0 and xmm1 are scratch. The rest hold variables and temporaries.
+#define XMM_FIRST 2
+#define XMM_COUNT 16
+
+typedef struct {
+  int offset;
+  // Whether a conditional jump jumped.
+  bool taken;
+} TraceStep;
+
+// A local the loop reads from below its own stack, or a global.
+typedef struct {
+  bool global;
+  int slot;
+  int xmm;
+} Variable;
+
+typedef struct {
+  CallFrame* frame;
+  Chunk* chunk;
+  int header;
+  // The loop's OpLoop or OpLoopLong.
+  int backEdge;
+  // Locals below this slot are variables. The ones above it live on
+  // the loop's own stack.
+  int base;
+  TraceStep steps[TRACE_MAX];
+  int stepCount;
+  Variable variables[TRACE_VARIABLES];
+  Value values[TRACE_VARIABLES];
+  int variableCount;
+  Value stack[TRACE_STACK];
+  int stackCount;
+} Recorder;
+
+typedef Value* (*TraceEntry)(CallFrame* frame, Value* stackTop);
+
+static bool falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static int findVariable(Recorder* recorder, bool global, int slot) {
+  for (int i = 0; i < recorder->variableCount; i++) {
+    Variable* variable = &recorder->variables[i];
+    if (variable->global == global && variable->slot == slot) return i;
+  }
+  return -1;
+}
+
+// Returns the variable for a local or global, adding it the first time
+// the loop touches it, or -1 if it can't be kept in a register.
+static int touchVariable(Recorder* recorder, bool global, int slot) {
+  int index = findVariable(recorder, global, slot);
+  if (index != -1) return index;
+  if (recorder->variableCount == TRACE_VARIABLES) return -1;
+
+  Value value = global ? vm.globalValues.values[slot]
+                       : recorder->frame->slots[slot];
+  if (!IS_NUMBER(value)) return -1;
+
+  index = recorder->variableCount++;
+  recorder->variables[index] = (Variable){global, slot, XMM_FIRST + index};
+  recorder->values[index] = value;
+  return index;
+}
+
+static bool recordPush(Recorder* recorder, Value value) {
+  if (recorder->stackCount == TRACE_STACK) return false;
+  recorder->stack[recorder->stackCount++] = value;
+  return true;
+}
+
+static bool recordPop(Recorder* recorder, Value* value) {
+  if (recorder->stackCount == 0) return false;
+  *value = recorder->stack[--recorder->stackCount];
+  return true;
+}
+
+// Points value at a local slot, or a global when global is set.
+static bool recordVariable(Recorder* recorder, bool global, int slot,
+                           Value** value) {
+  if (!global && slot >= recorder->base) {
+    if (slot - recorder->base >= recorder->stackCount) return false;
+    *value = &recorder->stack[slot - recorder->base];
+    return true;
+  }
+
+  int index = touchVariable(recorder, global, slot);
+  if (index == -1) return false;
+  *value = &recorder->values[index];
+  return true;
+}
+
+static bool numberOperation(uint8_t instruction, Value a, Value b,
+                            Value* result) {
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (instruction) {
+    case OpAdd:
+    case OpAddNum:
+    case OpAddStr:
+    case OpAddLocalConst:
+    case OpAddLocalConstNum:
+    case OpConcatN:
+      *result = NUMBER_VAL(x + y); return true;
+    case OpSubtract: *result = NUMBER_VAL(x - y); return true;
+    case OpMultiply: *result = NUMBER_VAL(x * y); return true;
+    case OpDivide: *result = NUMBER_VAL(x / y); return true;
+    case OpLess: *result = BOOL_VAL(x < y); return true;
+    case OpGreater: *result = BOOL_VAL(x > y); return true;
+    case OpGreaterEq: *result = BOOL_VAL(!(x < y)); return true;
+    case OpLessEq: *result = BOOL_VAL(!(x > y)); return true;
+    case OpEq:
+    case OpEqNum:
+      *result = BOOL_VAL(x == y); return true;
+    case OpNotEq:
+    case OpNotEqNum:
+      *result = BOOL_VAL(x != y); return true;
+    default:
+      return false;
+  }
+}
+
+typedef enum {
+  RECORD_LOOPED,
+  // The path left the loop, as it does on the last iteration.
+  RECORD_LEFT,
+  // The loop does something a trace can't: calls, strings, nested
+  // loops, values other than numbers in variables or too many steps.
+  RECORD_FAILED,
+} RecordResult;
+
+// Runs one iteration from the header, leaving the frame and globals
+// alone.
+static RecordResult record(Recorder* recorder) {
+  Chunk* chunk = recorder->chunk;
+  Value* constants = chunk->constants.values;
+  int offset = recorder->header;
+
+  for (;;) {
+    // The loop's code ends with its back-edge.
+    if (offset > recorder->backEdge) return RECORD_LEFT;
+    if (recorder->stepCount == TRACE_MAX) return RECORD_FAILED;
+    TraceStep* step = &recorder->steps[recorder->stepCount++];
+    step->offset = offset;
+    step->taken = false;
+
+    uint8_t* code = chunk->code + offset;
+    // Unchecked instructions behave like the generic ones here.
+    uint8_t instruction = checkedInstruction(code[0]);
+    int next = offset + instructionLength(chunk, offset);
+    Value a, b, result;
+    Value* variable;
+    switch (instruction) {
+      case OpConstant:
+        if (!recordPush(recorder, constants[code[1]])) return RECORD_FAILED;
+        break;
+      case OpConstantLong:
+        if (!recordPush(recorder, constants[readLong(code + 1)])) {
+          return RECORD_FAILED;
+        }
+        break;
+      case OpNil:
+        if (!recordPush(recorder, NIL_VAL)) return RECORD_FAILED;
+        break;
+      case OpTrue:
+        if (!recordPush(recorder, TRUE_VAL)) return RECORD_FAILED;
+        break;
+      case OpFalse:
+        if (!recordPush(recorder, FALSE_VAL)) return RECORD_FAILED;
+        break;
+      case OpNegate:
+        if (!recordPop(recorder, &a) || !IS_NUMBER(a)) return RECORD_FAILED;
+        recordPush(recorder, NUMBER_VAL(-AS_NUMBER(a)));
+        break;
+      case OpAdd:
+      case OpAddNum:
+      case OpAddStr:
+      case OpSubtract:
+      case OpMultiply:
+      case OpDivide:
+      case OpEq:
+      case OpEqNum:
+      case OpNotEq:
+      case OpNotEqNum:
+      case OpGreater:
+      case OpLess:
+      case OpGreaterEq:
+      case OpLessEq:
+        if (!recordPop(recorder, &b) || !recordPop(recorder, &a) ||
+            !numberOperation(instruction, a, b, &result)) {
+          return RECORD_FAILED;
+        }
+        recordPush(recorder, result);
+        break;
+      case OpNot:
+        if (!recordPop(recorder, &a)) return RECORD_FAILED;
+        recordPush(recorder, BOOL_VAL(falsey(a)));
+        break;
+      case OpGetLocal:
+        if (!recordVariable(recorder, false, code[1], &variable) ||
+            !recordPush(recorder, *variable)) {
+          return RECORD_FAILED;
+        }
+        break;
+      case OpSetLocal:
+        if (!recordVariable(recorder, false, code[1], &variable) ||
+            recorder->stackCount == 0) {
+          return RECORD_FAILED;
+        }
+        *variable = recorder->stack[recorder->stackCount - 1];
+        break;
+      case OpGetGlobal:
+      case OpGetGlobalLong: {
+        int slot = code[0] == OpGetGlobal ? code[1] : readLong(code + 1);
+        if (!recordVariable(recorder, true, slot, &variable) ||
+            !recordPush(recorder, *variable)) {
+          return RECORD_FAILED;
+        }
+        break;
+      }
+      case OpSetGlobal:
+      case OpSetGlobalLong:
+      case OpDefineGlobal:
+      case OpDefineGlobalLong: {
+        bool isShort = code[0] == OpSetGlobal || code[0] == OpDefineGlobal;
+        int slot = isShort ? code[1] : readLong(code + 1);
+        if (!recordVariable(recorder, true, slot, &variable) ||
+            recorder->stackCount == 0) {
+          return RECORD_FAILED;
+        }
+        *variable = recorder->stack[recorder->stackCount - 1];
+        break;
+      }
+      case OpPop:
+        if (!recordPop(recorder, &a)) return RECORD_FAILED;
+        break;
+      case OpPopN:
+        if (recorder->stackCount < code[1]) return RECORD_FAILED;
+        recorder->stackCount -= code[1];
+        break;
+      case OpJumpIfFalse:
+      case OpJumpIfFalseLong:
+      case OpJumpIfFalsePop:
+        if (recorder->stackCount == 0) return RECORD_FAILED;
+        step->taken = falsey(recorder->stack[recorder->stackCount - 1]);
+        if (step->taken) {
+          next = jumpTarget(chunk, offset);
+        } else if (code[0] == OpJumpIfFalsePop) {
+          recorder->stackCount--;
+        }
+        break;
+      case OpJumpIfNotLessLocalConst:
+      case OpJumpIfNotLessLocalLocal:
+        if (!recordVariable(recorder, false, code[1], &variable)) {
+          return RECORD_FAILED;
+        }
+        a = *variable;
+        if (code[0] == OpJumpIfNotLessLocalConst) {
+          b = constants[code[2]];
+        } else if (recordVariable(recorder, false, code[2], &variable)) {
+          b = *variable;
+        } else {
+          return RECORD_FAILED;
+        }
+        if (!numberOperation(OpLess, a, b, &result)) return RECORD_FAILED;
+        step->taken = !AS_BOOL(result);
+        if (step->taken) next = jumpTarget(chunk, offset);
+        break;
+      case OpJump:
+      case OpJumpLong:
+        next = jumpTarget(chunk, offset);
+        break;
+      case OpLoop:
+      case OpLoopLong:
+        // Only the loop's own back-edge closes the trace. Inner loops
+        // get traces of their own.
+        if (jumpTarget(chunk, offset) != recorder->header ||
+            recorder->stackCount != 0) {
+          return RECORD_FAILED;
+        }
+        return RECORD_LOOPED;
+      case OpConcatN: {
+        int count = code[1];
+        if (recorder->stackCount < count) return RECORD_FAILED;
+        Value* operands = recorder->stack + recorder->stackCount - count;
+        result = operands[0];
+        for (int i = 1; i < count; i++) {
+          if (!numberOperation(OpAdd, result, operands[i], &result)) {
+            return RECORD_FAILED;
+          }
+        }
+        recorder->stackCount -= count;
+        recordPush(recorder, result);
+        break;
+      }
+      case OpAddLocalConst:
+      case OpAddLocalConstNum:
+        if (!recordVariable(recorder, false, code[1], &variable) ||
+            !numberOperation(OpAdd, *variable, constants[code[2]],
+                             &result) ||
+            !recordPush(recorder, result)) {
+          return RECORD_FAILED;
+        }
+        break;
+      default:
+        return RECORD_FAILED;
+    }
+
+    offset = next;
+  }
+}
+
+// Where a value the trace works on is while it runs.
+typedef enum {
+  OPERAND_XMM,       // A number in an xmm register of its own.
+  OPERAND_VARIABLE,  // The current value of a variable.
+  OPERAND_CONSTANT,  // A value known when the trace is compiled.
+  OPERAND_CONDITION, // A comparison's result in AL, used right away.
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  // The xmm register or the variable.
+  int index;
+  Value constant;
+} Operand;
+
+typedef struct {
+  Recorder* recorder;
+  Assembler hot;
+  // Side exit stubs, placed after the hot code.
+  Assembler cold;
+  Operand stack[TRACE_STACK];
+  int stackCount;
+  // Bit n is set when xmm n is free for a temporary.
+  uint32_t freeXmm;
+  bool failed;
+} TraceCompiler;
+
+static Operand constantOperand(Value value) {
+  return (Operand){OPERAND_CONSTANT, 0, value};
+}
+
+static int allocateXmm(TraceCompiler* compiler) {
+  for (int xmm = XMM_FIRST; xmm < XMM_COUNT; xmm++) {
+    if (compiler->freeXmm & (1u << xmm)) {
+      compiler->freeXmm &= ~(1u << xmm);
+      return xmm;
+    }
+  }
+  compiler->failed = true;
+  return 0;
+}
+
+static void freeOperand(TraceCompiler* compiler, Operand* operand) {
+  if (operand->kind == OPERAND_XMM) {
+    compiler->freeXmm |= 1u << operand->index;
+  }
+}
+
+static void pushOperand(TraceCompiler* compiler, Operand operand) {
+  if (compiler->stackCount == TRACE_STACK) {
+    compiler->failed = true;
+    return;
+  }
+  compiler->stack[compiler->stackCount++] = operand;
+}
+
+static Operand popOperand(TraceCompiler* compiler) {
+  if (compiler->stackCount == 0) {
+    compiler->failed = true;
+    return constantOperand(NIL_VAL);
+  }
+  return compiler->stack[--compiler->stackCount];
+}
+
+static Operand* topOperand(TraceCompiler* compiler) {
+  return &compiler->stack[compiler->stackCount - 1];
+}
+
+// Returns the xmm register a number operand is in, loading constants
+// into scratch.
+static int operandXmm(TraceCompiler* compiler, Operand* operand,
+                      int scratch) {
+  switch (operand->kind) {
+    case OPERAND_XMM:
+      return operand->index;
+    case OPERAND_VARIABLE:
+      return compiler->recorder->variables[operand->index].xmm;
+    case OPERAND_CONSTANT:
+      moveImmediate(&compiler->hot, RAX, operand->constant);
+      toXmm(&compiler->hot, scratch, RAX);
+      return scratch;
+    case OPERAND_CONDITION:
+      break;
+  }
+  compiler->failed = true;
+  return scratch;
+}
+
+// Copies a number operand into a temporary it owns, unless it already
+// is one, and returns the register.
+static int ownXmm(TraceCompiler* compiler, Operand* operand) {
+  if (operand->kind == OPERAND_XMM) return operand->index;
+
+  int xmm = allocateXmm(compiler);
+  int source = operandXmm(compiler, operand, xmm);
+  if (source != xmm) moveXmm(&compiler->hot, xmm, source);
+  *operand = (Operand){OPERAND_XMM, xmm, 0};
+  return xmm;
+}
+
+// A copy of operand that can be changed without changing it.
+static Operand copyOperand(TraceCompiler* compiler, Operand operand) {
+  if (operand.kind == OPERAND_CONDITION) compiler->failed = true;
+  if (operand.kind != OPERAND_XMM) return operand;
+
+  int xmm = allocateXmm(compiler);
+  moveXmm(&compiler->hot, xmm, operand.index);
+  return (Operand){OPERAND_XMM, xmm, 0};
+}
+
+// Puts the boxed value of operand in RAX.
+static void materialize(TraceCompiler* compiler, Assembler* as,
+                        Operand* operand) {
+  switch (operand->kind) {
+    case OPERAND_XMM:
+      fromXmm(as, RAX, operand->index);
+      break;
+    case OPERAND_VARIABLE:
+      fromXmm(as, RAX,
+              compiler->recorder->variables[operand->index].xmm);
+      break;
+    case OPERAND_CONSTANT:
+      moveImmediate(as, RAX, operand->constant);
+      break;
+    case OPERAND_CONDITION:
+      compiler->failed = true;
+      break;
+  }
+}
+
+// Jumps on cc to a stub that stores the variables and the stack as
+// they are now and leaves to the interpreter at target.
+static void sideExit(TraceCompiler* compiler, int cc, int target) {
+  Recorder* recorder = compiler->recorder;
+  Assembler* as = &compiler->cold;
+  jumpTo(&compiler->hot, cc, as->count, true);
+
+  for (int i = 0; i < recorder->variableCount; i++) {
+    Variable* variable = &recorder->variables[i];
+    fromXmm(as, RAX, variable->xmm);
+    store(as, variable->global ? GLOBALS : SLOTS,
+          variable->slot * (int32_t)sizeof(Value), RAX);
+  }
+  for (int i = 0; i < compiler->stackCount; i++) {
+    materialize(compiler, as, &compiler->stack[i]);
+    store(as, STACK, i * (int32_t)sizeof(Value), RAX);
+  }
+
+  moveImmediate(as, RAX,
+                (uint64_t)(uintptr_t)(recorder->chunk->code + target));
+  store(as, FRAME, offsetof(CallFrame, ip), RAX);
+  registers(as, MOV, RAX, STACK);
+  addImmediate(as, RAX, compiler->stackCount * (int32_t)sizeof(Value));
+  // restoreRegisters() is at the start of the cold code.
+  emitByte(as, 0xe9);
+  emit32(as, (uint32_t)(0 - (as->count + 4)));
+}
+
+// Leaves at next if xmm holds a NaN, which isn't a number to the
+// interpreter.
+static void guardNaN(TraceCompiler* compiler, int xmm, int next) {
+  ucomisd(&compiler->hot, xmm, xmm);
+  sideExit(compiler, CC_P, next);
+}
+
+static void traceArithmetic(TraceCompiler* compiler, uint8_t op,
+                            int next) {
+  Operand b = popOperand(compiler);
+  Operand a = popOperand(compiler);
+  if (a.kind == OPERAND_CONSTANT && b.kind == OPERAND_CONSTANT) {
+    double x = AS_NUMBER(a.constant);
+    double y = AS_NUMBER(b.constant);
+    double result = op == ADDSD ? x + y : op == SUBSD ? x - y
+                  : op == MULSD ? x * y : x / y;
+    if (!IS_NUMBER(NUMBER_VAL(result))) compiler->failed = true;
+    pushOperand(compiler, constantOperand(NUMBER_VAL(result)));
+    return;
+  }
+
+  int xmm = ownXmm(compiler, &a);
+  scalar(&compiler->hot, op, xmm, operandXmm(compiler, &b, 0));
+  freeOperand(compiler, &b);
+  pushOperand(compiler, a);
+  guardNaN(compiler, xmm, next);
+}
+
+static void traceComparison(TraceCompiler* compiler,
+                            uint8_t instruction) {
+  Operand b = popOperand(compiler);
+  Operand a = popOperand(compiler);
+  if (a.kind == OPERAND_CONSTANT && b.kind == OPERAND_CONSTANT) {
+    Value result;
+    numberOperation(instruction, a.constant, b.constant, &result);
+    pushOperand(compiler, constantOperand(result));
+    return;
+  }
+
+  int x = operandXmm(compiler, &a, 0);
+  int y = operandXmm(compiler, &b, 1);
+  compareXmm(&compiler->hot, instruction, x, y);
+  freeOperand(compiler, &a);
+  freeOperand(compiler, &b);
+  pushOperand(compiler, (Operand){OPERAND_CONDITION, 0, 0});
+}
+
+// The operand for a local, either a variable or a value on the loop's
+// own stack.
+static Operand* localOperand(TraceCompiler* compiler, int slot,
+                             Operand* variable) {
+  Recorder* recorder = compiler->recorder;
+  if (slot >= recorder->base) {
+    return &compiler->stack[slot - recorder->base];
+  }
+  *variable = (Operand){OPERAND_VARIABLE,
+                        findVariable(recorder, false, slot), 0};
+  return variable;
+}
+
+// Stores the value on top of the stack in a variable.
+static void writeVariable(TraceCompiler* compiler, int index) {
+  Operand* top = topOperand(compiler);
+  if (top->kind == OPERAND_VARIABLE && top->index == index) return;
+
+  // Values already read from the variable keep the old value.
+  int xmm = compiler->recorder->variables[index].xmm;
+  for (int i = 0; i < compiler->stackCount; i++) {
+    Operand* operand = &compiler->stack[i];
+    if (operand->kind == OPERAND_VARIABLE && operand->index == index) {
+      ownXmm(compiler, operand);
+    }
+  }
+
+  if (top->kind == OPERAND_CONSTANT && !IS_NUMBER(top->constant)) {
+    compiler->failed = true;
+    return;
+  }
+  int source = operandXmm(compiler, top, xmm);
+  if (source != xmm) moveXmm(&compiler->hot, xmm, source);
+  freeOperand(compiler, top);
+  *top = (Operand){OPERAND_VARIABLE, index, 0};
+}
+
+static void writeLocal(TraceCompiler* compiler, int slot) {
+  Recorder* recorder = compiler->recorder;
+  if (slot < recorder->base) {
+    writeVariable(compiler, findVariable(recorder, false, slot));
+    return;
+  }
+
+  Operand* local = &compiler->stack[slot - recorder->base];
+  Operand* top = topOperand(compiler);
+  if (local == top) return;
+  freeOperand(compiler, local);
+  *local = copyOperand(compiler, *top);
+}
+
+static void traceConditionalJump(TraceCompiler* compiler,
+                                 TraceStep* step, int next) {
+  Chunk* chunk = compiler->recorder->chunk;
+  bool pops = chunk->code[step->offset] == OpJumpIfFalsePop;
+  int target = jumpTarget(chunk, step->offset);
+  Operand* top = topOperand(compiler);
+
+  if (top->kind == OPERAND_CONDITION) {
+    // test al, al
+    emitByte(&compiler->hot, 0x84);
+    emitByte(&compiler->hot, 0xc0);
+
+    if (step->taken) {
+      // Leaves at the next instruction when the condition is true.
+      if (pops) {
+        compiler->stackCount--;
+      } else {
+        *top = constantOperand(TRUE_VAL);
+      }
+      sideExit(compiler, CC_NE, next);
+      if (pops) compiler->stackCount++;
+      *top = constantOperand(FALSE_VAL);
+    } else {
+      // Leaves where the jump goes when it is false.
+      *top = constantOperand(FALSE_VAL);
+      sideExit(compiler, CC_E, target);
+      *top = constantOperand(TRUE_VAL);
+      if (pops) compiler->stackCount--;
+    }
+    return;
+  }
+
+  // Anything else goes the same way every time: numbers are true.
+  if (!step->taken && pops) {
+    Operand operand = popOperand(compiler);
+    freeOperand(compiler, &operand);
+  }
+}
+
+static void traceJumpIfNotLess(TraceCompiler* compiler, TraceStep* step,
+                               int next) {
+  Recorder* recorder = compiler->recorder;
+  uint8_t* code = recorder->chunk->code + step->offset;
+  Operand left, right;
+  int x = operandXmm(compiler, localOperand(compiler, code[1], &left), 0);
+  Operand* operand;
+  if (code[0] == OpJumpIfNotLessLocalConst) {
+    right = constantOperand(recorder->chunk->constants.values[code[2]]);
+    operand = &right;
+  } else {
+    operand = localOperand(compiler, code[2], &right);
+  }
+  int y = operandXmm(compiler, operand, 1);
+
+  // Above when x < y.
+  ucomisd(&compiler->hot, y, x);
+  if (step->taken) {
+    sideExit(compiler, CC_A, next);
+  } else {
+    sideExit(compiler, CC_BE, jumpTarget(recorder->chunk, step->offset));
+  }
+}
+
+static void traceStep(TraceCompiler* compiler, TraceStep* step) {
+  Recorder* recorder = compiler->recorder;
+  Chunk* chunk = recorder->chunk;
+  uint8_t* code = chunk->code + step->offset;
+  int next = step->offset + instructionLength(chunk, step->offset);
+
+  // A comparison's result only lasts until the next instruction.
+  if (compiler->stackCount > 0 &&
+      topOperand(compiler)->kind == OPERAND_CONDITION &&
+      code[0] != OpJumpIfFalse && code[0] != OpJumpIfFalseLong &&
+      code[0] != OpJumpIfFalsePop && code[0] != OpNot) {
+    compiler->failed = true;
+    return;
+  }
+
+  Operand operand;
+  switch (checkedInstruction(code[0])) {
+    case OpConstant:
+      pushOperand(compiler,
+                  constantOperand(chunk->constants.values[code[1]]));
+      break;
+    case OpConstantLong:
+      pushOperand(compiler, constantOperand(
+          chunk->constants.values[readLong(code + 1)]));
+      break;
+    case OpNil: pushOperand(compiler, constantOperand(NIL_VAL)); break;
+    case OpTrue: pushOperand(compiler, constantOperand(TRUE_VAL)); break;
+    case OpFalse:
+      pushOperand(compiler, constantOperand(FALSE_VAL));
+      break;
+    case OpNegate: {
+      Operand* top = topOperand(compiler);
+      if (top->kind == OPERAND_CONSTANT) {
+        top->constant = NUMBER_VAL(-AS_NUMBER(top->constant));
+        break;
+      }
+      int xmm = ownXmm(compiler, top);
+      moveImmediate(&compiler->hot, RAX, SIGN_BIT);
+      toXmm(&compiler->hot, 0, RAX);
+      // xorpd
+      xmmRegisters(&compiler->hot, 0x66, 0x57, xmm, 0);
+      break;
+    }
+    case OpAdd:
+    case OpAddNum:
+    case OpAddStr:
+      traceArithmetic(compiler, ADDSD, next);
+      break;
+    case OpSubtract: traceArithmetic(compiler, SUBSD, next); break;
+    case OpMultiply: traceArithmetic(compiler, MULSD, next); break;
+    case OpDivide: traceArithmetic(compiler, DIVSD, next); break;
+    case OpEq:
+    case OpEqNum:
+    case OpNotEq:
+    case OpNotEqNum:
+    case OpGreater:
+    case OpLess:
+    case OpGreaterEq:
+    case OpLessEq:
+      traceComparison(compiler, checkedInstruction(code[0]));
+      break;
+    case OpNot: {
+      Operand* top = topOperand(compiler);
+      if (top->kind == OPERAND_CONDITION) {
+        // xor al, 1
+        emitByte(&compiler->hot, 0x34);
+        emitByte(&compiler->hot, 0x01);
+      } else if (top->kind == OPERAND_CONSTANT) {
+        top->constant = BOOL_VAL(falsey(top->constant));
+      } else {
+        freeOperand(compiler, top);
+        *top = constantOperand(FALSE_VAL);
+      }
+      break;
+    }
+    case OpGetLocal:
+      pushOperand(compiler, copyOperand(compiler,
+          *localOperand(compiler, code[1], &operand)));
+      break;
+    case OpSetLocal:
+      writeLocal(compiler, code[1]);
+      break;
+    case OpGetGlobal:
+    case OpGetGlobalLong: {
+      int slot = code[0] == OpGetGlobal ? code[1] : readLong(code + 1);
+      pushOperand(compiler, (Operand){OPERAND_VARIABLE,
+          findVariable(recorder, true, slot), 0});
+      break;
+    }
+    case OpSetGlobal:
+    case OpDefineGlobal:
+      writeVariable(compiler, findVariable(recorder, true, code[1]));
+      break;
+    case OpSetGlobalLong:
+    case OpDefineGlobalLong:
+      writeVariable(compiler,
+                    findVariable(recorder, true, readLong(code + 1)));
+      break;
+    case OpPop:
+      operand = popOperand(compiler);
+      freeOperand(compiler, &operand);
+      break;
+    case OpPopN:
+      for (int i = 0; i < code[1]; i++) {
+        operand = popOperand(compiler);
+        freeOperand(compiler, &operand);
+      }
+      break;
+    case OpJumpIfFalse:
+    case OpJumpIfFalseLong:
+    case OpJumpIfFalsePop:
+      traceConditionalJump(compiler, step, next);
+      break;
+    case OpJumpIfNotLessLocalConst:
+    case OpJumpIfNotLessLocalLocal:
+      traceJumpIfNotLess(compiler, step, next);
+      break;
+    case OpJump:
+    case OpJumpLong:
+    case OpLoop:
+    case OpLoopLong:
+      break;
+    case OpConcatN: {
+      int count = code[1];
+      Operand* operands = compiler->stack + compiler->stackCount - count;
+      int xmm = ownXmm(compiler, &operands[0]);
+      for (int i = 1; i < count; i++) {
+        scalar(&compiler->hot, ADDSD, xmm,
+               operandXmm(compiler, &operands[i], 0));
+        freeOperand(compiler, &operands[i]);
+      }
+      compiler->stackCount -= count - 1;
+      guardNaN(compiler, xmm, next);
+      break;
+    }
+    case OpAddLocalConst:
+    case OpAddLocalConstNum:
+      pushOperand(compiler, copyOperand(compiler,
+          *localOperand(compiler, code[1], &operand)));
+      pushOperand(compiler,
+                  constantOperand(chunk->constants.values[code[2]]));
+      traceArithmetic(compiler, ADDSD, next);
+      break;
+    default:
+      compiler->failed = true;
+      break;
+  }
+}
+
+// Compiles the recorded steps, or returns NULL. The code checks the
+// variables are numbers and loads them, then runs the steps over and
+// over until a side exit.
+static uint8_t* compileTrace(Recorder* recorder, size_t* size) {
+  TraceCompiler compiler;
+  compiler.recorder = recorder;
+  compiler.hot = (Assembler){NULL, 0, 0, NULL, 0, 0};
+  compiler.cold = (Assembler){NULL, 0, 0, NULL, 0, 0};
+  compiler.stackCount = 0;
+  compiler.freeXmm = 0;
+  for (int xmm = XMM_FIRST + recorder->variableCount; xmm < XMM_COUNT;
+       xmm++) {
+    compiler.freeXmm |= 1u << xmm;
+  }
+  compiler.failed = false;
+
+  Assembler* hot = &compiler.hot;
+  Assembler* cold = &compiler.cold;
+  restoreRegisters(cold);
+
+  // Where the trace goes if a variable isn't a number. Nothing has been
+  // changed yet.
+  int notNumber = cold->count;
+  moveImmediate(cold, RAX, (uint64_t)(uintptr_t)(recorder->chunk->code +
+                                                 recorder->header));
+  store(cold, FRAME, offsetof(CallFrame, ip), RAX);
+  registers(cold, MOV, RAX, STACK);
+  emitByte(cold, 0xe9);
+  emit32(cold, (uint32_t)(0 - (cold->count + 4)));
+
+  saveRegisters(hot);
+  registers(hot, MOV, FRAME, RDI);
+  registers(hot, MOV, STACK, RSI);
+  load(hot, SLOTS, FRAME, offsetof(CallFrame, slots));
+  moveImmediate(hot, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  load(hot, GLOBALS, RAX, 0);
+
+  moveImmediate(hot, RDX, QNAN);
+  for (int i = 0; i < recorder->variableCount; i++) {
+    Variable* variable = &recorder->variables[i];
+    load(hot, RAX, variable->global ? GLOBALS : SLOTS,
+         variable->slot * (int32_t)sizeof(Value));
+    registers(hot, MOV, RSI, RAX);
+    registers(hot, AND, RSI, RDX);
+    registers(hot, CMP, RSI, RDX);
+    jumpTo(hot, CC_E, notNumber, true);
+    toXmm(hot, variable->xmm, RAX);
+  }
+
+  int loop = hot->count;
+  for (int i = 0; i < recorder->stepCount && !compiler.failed; i++) {
+    traceStep(&compiler, &recorder->steps[i]);
+  }
+  emitByte(hot, 0xe9);
+  emit32(hot, (uint32_t)(loop - (hot->count + 4)));
+
+  uint8_t* code = NULL;
+  if (!compiler.failed && compiler.stackCount == 0) {
+    // Every jump out of the hot code goes to a stub in the cold code.
+    for (int i = 0; i < hot->patchCount; i++) {
+      Patch* patch = &hot->patches[i];
+      uint32_t distance = (uint32_t)(hot->count + patch->target -
+                                     (patch->at + 4));
+      memcpy(hot->code + patch->at, &distance, sizeof(distance));
+    }
+    for (int i = 0; i < cold->count; i++) emitByte(hot, cold->code[i]);
+
+    code = installCode(hot);
+    *size = hot->count;
+  }
+
+  FREE_ARRAY(uint8_t, hot->code, hot->capacity);
+  FREE_ARRAY(Patch, hot->patches, hot->patchCapacity);
+  FREE_ARRAY(uint8_t, cold->code, cold->capacity);
+  FREE_ARRAY(Patch, cold->patches, cold->patchCapacity);
+  return code;
+}
+
+static Trace* findTrace(ObjFunction* function, uint8_t* header) {
+  for (Trace* trace = function->traces; trace != NULL;
+       trace = trace->next) {
+    if (trace->header == header) return trace;
+  }
+  return NULL;
+}
+
+void traceLoop(CallFrame* frame, uint8_t* backEdge) {
+  ObjFunction* function = frame->function;
+  uint8_t* header = frame->ip;
+  vm.hotLoops[HOT_LOOP_SLOT(header)] = HOT_LOOP_THRESHOLD;
+
+  Trace* trace = findTrace(function, header);
+  if (trace == NULL) {
+    Recorder recorder;
+    recorder.frame = frame;
+    recorder.chunk = &function->chunk;
+    recorder.header = (int)(header - function->chunk.code);
+    recorder.backEdge = (int)(backEdge - function->chunk.code);
+    recorder.base = (int)(vm.stackTop - frame->slots);
+    recorder.stepCount = 0;
+    recorder.variableCount = 0;
+    recorder.stackCount = 0;
+
+    RecordResult result = record(&recorder);
+    if (result == RECORD_LEFT) {
+      // Recording started on the last iteration. Trying again at the
+      // next back-edge catches the loop where it goes round, even when
+      // its trip count divides HOT_LOOP_THRESHOLD.
+      vm.hotLoops[HOT_LOOP_SLOT(header)] = 1;
+      return;
+    }
+
+    trace = ALLOCATE(Trace, 1);
+    trace->header = header;
+    trace->code = NULL;
+    trace->size = 0;
+    if (result == RECORD_LOOPED) {
+      trace->code = compileTrace(&recorder, &trace->size);
+    }
+    // A trace without code keeps the loop from being recorded again.
+    trace->next = function->traces;
+    function->traces = trace;
+  }
+  if (trace->code == NULL) return;
+
+  TraceEntry entry = (TraceEntry)(void*)trace->code;
+  vm.stackTop = entry(frame, vm.stackTop);
+
+  // Unless a variable wasn't a number, the trace left somewhere in or
+  // after the loop, so it is worth going back in at the next back-edge.
+  if (frame->ip != header) vm.hotLoops[HOT_LOOP_SLOT(header)] = 1;
+}
+
+#endif
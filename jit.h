@@ -0,0 +1,70 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#ifndef mti_jit_h
+#define mti_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+// Functions are compiled to machine code on their JIT_THRESHOLD-th call.
+#define JIT_THRESHOLD 100
+
+// A function's machine code. It can be entered at the start of any
+// instruction and runs until it reaches one it leaves to the
+// interpreter: calls, returns, anything without a template, and
+// instructions whose operands fail the template's type checks.
+typedef struct JitCode {
+  uint8_t* code;
+  size_t size;
+  // Where each instruction starts in code, by its offset in the chunk.
+  uint32_t* entries;
+  int entryCount;
+} JitCode;
+
+// Loop back-edges count down in vm.hotLoops, in a slot picked by the
+// address of the loop's first instruction. When a count reaches zero
+// the loop is traced.
+#define HOT_LOOP_THRESHOLD 64
+#define HOT_LOOP_SLOT(ip) ((uintptr_t)(ip) & (HOT_LOOPS - 1))
+
+// Machine code for one iteration of a loop, along the path it took
+// when it was recorded, that jumps back to its own start.
+typedef struct Trace {
+  // The loop's first instruction.
+  uint8_t* header;
+  // NULL if the loop does something a trace can't.
+  uint8_t* code;
+  size_t size;
+  struct Trace* next;
+} Trace;
+
+void jitCompile(ObjFunction* function);
+// Frees the function's machine code and traces.
+void jitFree(ObjFunction* function);
+
+// Called at the top of a loop in frame when its count runs out, with
+// the back-edge that jumped there. Runs the loop's trace, recording and
+// compiling it first if there isn't one. Returns with frame->ip and
+// vm.stackTop set to where the interpreter carries on.
+void traceLoop(CallFrame* frame, uint8_t* backEdge);
+
+// Runs frame in machine code from frame->ip. Returns with frame->ip and
+// vm.stackTop set to where the interpreter carries on.
+void jitRun(CallFrame* frame);
+#endif
+
+#endif
@@ -13,8 +13,10 @@
    along with this program.  If not, see <https://www.gnu.org/licenses/>.
    */
 
+#include "aot.h"
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
 #include <stdio.h>
@@ -73,14 +75,45 @@ static void runFile(const char* path) {
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+#ifdef AOT
+// Builds the script at path into a shared object at out.
+static void buildFile(const char* out, const char* path) {
+  char* source = readFile(path);
+  ObjFunction* script = compile(source);
+  if (script == NULL) exit(65);
+
+  bool built = aotBuild(script, source, out);
+  free(source);
+  if (!built) exit(74);
+}
+
+// Runs a script from a shared object built by buildFile().
+static void runModule(const char* path) {
+  ObjFunction* script = aotLoad(path);
+  if (script == NULL) exit(74);
+
+  InterpretResult result = interpretFunction(script);
+  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+#endif
+
 int main(int argc, const char** argv) {
   initVM();
   if (argc == 1) {
     repl();
+#ifdef AOT
+  } else if (argc == 2 && aotIsModule(argv[1])) {
+    runModule(argv[1]);
+  } else if (argc == 4 && strcmp(argv[1], "--aot") == 0) {
+    buildFile(argv[2], argv[3]);
+#endif
   } else if (argc == 2) {
     runFile(argv[1]);
   } else {
     fprintf(stderr, "Usage: clox [path]\n");
+#ifdef AOT
+    fprintf(stderr, "       clox --aot out.so path\n");
+#endif
     exit(64);
   }
 
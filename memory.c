@@ -14,11 +14,143 @@
    */
 
 #include <stdlib.h>
+#include <string.h>
 
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+#define GC_HEAP_GROW_FACTOR 2
+
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+#ifdef POOL_ALLOCATOR
+
+// Blocks up to POOL_MAX_SIZE bytes are rounded up to a multiple of
+// POOL_GRANULE and carved out of slabs shared by every block of that
+// size class. Freed blocks go onto the class's free list and are never
+// returned to the C allocator before freePools().
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define SLAB_SIZE (64 * 1024)
+
+typedef struct PoolBlock {
+  struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct Slab {
+  struct Slab* next;
+} Slab;
+
+typedef struct {
+  PoolBlock* freeList;
+  uint8_t* top;
+  uint8_t* end;
+} Pool;
+
+static Pool pools[POOL_CLASSES];
+static Slab* slabs = NULL;
+
+static inline int sizeClass(size_t size) {
+  if (size == 0 || size > POOL_MAX_SIZE) return -1;
+  return (int)((size - 1) / POOL_GRANULE);
+}
+
+static void* poolAllocate(int sizeClass) {
+  Pool* pool = &pools[sizeClass];
+  if (pool->freeList != NULL) {
+    PoolBlock* block = pool->freeList;
+    pool->freeList = block->next;
+    return block;
+  }
+
+  size_t blockSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+  if (pool->top + blockSize > pool->end) {
+    Slab* slab = (Slab*)malloc(SLAB_SIZE);
+    if (slab == NULL) exit(1);
+    slab->next = slabs;
+    slabs = slab;
+    pool->top = (uint8_t*)slab + POOL_GRANULE;
+    pool->end = (uint8_t*)slab + SLAB_SIZE;
+  }
+
+  void* result = pool->top;
+  pool->top += blockSize;
+  return result;
+}
+
+static void poolFree(int sizeClass, void* pointer) {
+  PoolBlock* block = (PoolBlock*)pointer;
+  block->next = pools[sizeClass].freeList;
+  pools[sizeClass].freeList = block;
+}
+
+static void* allocatorResize(void* pointer, size_t oldSize,
+                             size_t newSize) {
+  int oldClass = pointer == NULL ? -1 : sizeClass(oldSize);
+  int newClass = sizeClass(newSize);
+
+  if (oldClass == -1 && newClass == -1) {
+    if (newSize == 0) {
+      free(pointer);
+      return NULL;
+    }
+
+    void* result = realloc(pointer, newSize);
+    if (result == NULL) exit(1);
+    return result;
+  }
+
+  if (oldClass == newClass) return pointer;
+
+  void* result = NULL;
+  if (newClass != -1) {
+    result = poolAllocate(newClass);
+  } else if (newSize > 0) {
+    result = malloc(newSize);
+    if (result == NULL) exit(1);
+  }
+
+  if (pointer != NULL) {
+    if (result != NULL) {
+      memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    }
+
+    if (oldClass != -1) {
+      poolFree(oldClass, pointer);
+    } else {
+      free(pointer);
+    }
+  }
+
+  return result;
+}
+
+void freePools() {
+  while (slabs != NULL) {
+    Slab* next = slabs->next;
+    free(slabs);
+    slabs = next;
+  }
+
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    pools[i].freeList = NULL;
+    pools[i].top = NULL;
+    pools[i].end = NULL;
+  }
+}
+
+#else
+
+static void* allocatorResize(void* pointer, size_t oldSize,
+                             size_t newSize) {
+  (void)oldSize;
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -29,16 +161,169 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-static void freeObject(Obj* object) {
+void freePools() {
+}
+
+#endif
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize && !vm.inMinorGC && !vm.inMajorGC) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+
+    if (vm.bytesAllocated > vm.nextGC) {
+      collectGarbage();
+    }
+  }
+
+  return allocatorResize(pointer, oldSize, newSize);
+}
+
+static inline bool isYoung(Obj* object) {
+  return (uint8_t*)object >= vm.nursery &&
+         (uint8_t*)object < vm.nurseryEnd;
+}
+
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case ObjTypeString:
+      return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    case ObjTypeRope:
+      return sizeof(ObjRope);
+    case ObjTypeFunction:
+      return sizeof(ObjFunction);
+  }
+
+  return 0; // Unreachable.
+}
+
+void* allocateYoung(size_t size) {
+  if (size > NURSERY_MAX_OBJECT) return NULL;
+
+  if (vm.nursery == NULL) {
+    vm.nursery = (uint8_t*)malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL) exit(1);
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+  }
+
+  size = NURSERY_ALIGN(size);
+  if (vm.nurseryTop + size > vm.nurseryEnd) return NULL;
+
+  void* result = vm.nurseryTop;
+  vm.nurseryTop += size;
+  return result;
+}
+
+void reserveYoung(size_t size) {
+  if (vm.nursery == NULL || size > NURSERY_MAX_OBJECT) return;
+
+#ifdef DEBUG_STRESS_GC
+  collectNursery();
+#endif
+
+  if (vm.nurseryTop + NURSERY_ALIGN(size) > vm.nurseryEnd) {
+    collectNursery();
+  }
+}
+
+void writeBarrier(Obj* owner, Value value) {
+  if (owner->isRemembered || isYoung(owner)) return;
+  if (!IS_OBJ(value) || !isYoung(AS_OBJ(value))) return;
+
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered = (Obj**)realloc(vm.remembered,
+        sizeof(Obj*) * vm.rememberedCapacity);
+    if (vm.remembered == NULL) exit(1);
+  }
+
+  owner->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = owner;
+}
+
+static void pushGray(Obj* object) {
+  if (vm.grayCapacity < vm.grayCount + 1) {
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    // The gray stack is not part of the managed heap, so it is grown
+    // with realloc() directly to avoid recursing into the collector.
+    vm.grayStack = (Obj**)realloc(vm.grayStack,
+                                  sizeof(Obj*) * vm.grayCapacity);
+    if (vm.grayStack == NULL) exit(1);
+  }
+
+  vm.grayStack[vm.grayCount++] = object;
+}
+
+void markObject(Obj* object) {
+  if (object == NULL) return;
+  if (object->isMarked) return;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  object->isMarked = true;
+  pushGray(object);
+}
+
+void markValue(Value value) {
+  if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(array->values[i]);
+  }
+}
+
+static void blackenObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
   switch (object->type) {
-    case ObjTypeString: {
-      ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+    case ObjTypeFunction: {
+      ObjFunction* function = (ObjFunction*)object;
+      markObject((Obj*)function->name);
+      markArray(&function->chunk.constants);
+      break;
+    }
+    case ObjTypeRope: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj*)rope->flat);
       break;
     }
+    case ObjTypeString:
+      break;
+  }
+}
+
+static void freeObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
+  switch (object->type) {
+    case ObjTypeString:
+      reallocate(object, objectSize(object), 0);
+      break;
+    case ObjTypeRope:
+      FREE(ObjRope, object);
+      break;
     case ObjTypeFunction: {
       ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT
+      jitFree(function);
+#endif
       freeChunk(&function->chunk);
       FREE(ObjFunction, object);
       break;
@@ -46,6 +331,232 @@ static void freeObject(Obj* object) {
   }
 }
 
+// Releases the out-of-line storage of a nursery object that did not
+// survive. The object itself goes away when the nursery is reset.
+static void finalizeYoung(Obj* object) {
+  switch (object->type) {
+    case ObjTypeString:
+    case ObjTypeRope:
+      break;
+    case ObjTypeFunction:
+      freeChunk(&((ObjFunction*)object)->chunk);
+      break;
+  }
+}
+
+static Obj* promoteObject(Obj* object) {
+  if (object == NULL || !isYoung(object)) return object;
+  if (object->next != NULL) return object->next;
+
+  size_t size = objectSize(object);
+  Obj* promoted = (Obj*)reallocate(NULL, 0, size);
+  memcpy(promoted, object, size);
+
+  promoted->next = vm.objects;
+  vm.objects = promoted;
+  object->next = promoted;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p promote to %p\n", (void*)object, (void*)promoted);
+#endif
+
+  pushGray(promoted);
+  return promoted;
+}
+
+static void promoteValue(Value* slot) {
+  if (IS_OBJ(*slot)) *slot = OBJ_VAL(promoteObject(AS_OBJ(*slot)));
+}
+
+static void promoteArray(ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    promoteValue(&array->values[i]);
+  }
+}
+
+static void promoteReferences(Obj* object) {
+  switch (object->type) {
+    case ObjTypeFunction: {
+      ObjFunction* function = (ObjFunction*)object;
+      function->name = (ObjString*)promoteObject((Obj*)function->name);
+      promoteArray(&function->chunk.constants);
+      break;
+    }
+    case ObjTypeRope: {
+      ObjRope* rope = (ObjRope*)object;
+      rope->left = promoteObject(rope->left);
+      rope->right = promoteObject(rope->right);
+      rope->flat = (ObjString*)promoteObject((Obj*)rope->flat);
+      break;
+    }
+    case ObjTypeString:
+      break;
+  }
+}
+
+// Minor collections only run from reserveYoung(), which the VM calls
+// at points where every live object is reachable from the roots below.
+// The compiler never triggers one, so its functions are not roots here.
+void collectNursery() {
+  if (vm.nursery == NULL || vm.inMinorGC) return;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  vm.inMinorGC = true;
+
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    promoteValue(slot);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].function =
+        (ObjFunction*)promoteObject((Obj*)vm.frames[i].function);
+  }
+
+  // Rewriting a key in place keeps its position since the hash is
+  // unchanged.
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry* entry = &vm.globals.entries[i];
+    entry->key = (ObjString*)promoteObject((Obj*)entry->key);
+  }
+  promoteArray(&vm.globalValues);
+  promoteArray(&vm.globalNames);
+
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    promoteReferences(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
+
+  while (vm.grayCount > 0) {
+    promoteReferences(vm.grayStack[--vm.grayCount]);
+  }
+
+  // The intern table is weak: survivors are rekeyed to their promoted
+  // copies and everything else is dropped.
+  for (uint8_t* p = vm.nursery; p < vm.nurseryTop;) {
+    Obj* object = (Obj*)p;
+    p += NURSERY_ALIGN(objectSize(object));
+
+    if (object->next != NULL) {
+      if (object->type == ObjTypeString) {
+        stringSetRelocate(&vm.strings, (ObjString*)object,
+                          (ObjString*)object->next);
+      }
+    } else {
+      if (object->type == ObjTypeString) {
+        stringSetDelete(&vm.strings, (ObjString*)object);
+      }
+      finalizeYoung(object);
+    }
+  }
+
+  vm.nurseryTop = vm.nursery;
+  vm.inMinorGC = false;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm.bytesAllocated - before);
+#endif
+
+  if (vm.bytesAllocated > vm.nextGC) collectGarbage();
+}
+
+static void markRoots() {
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    markValue(*slot);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    markObject((Obj*)vm.frames[i].function);
+  }
+
+  markTable(&vm.globals);
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
+  markCompilerRoots();
+}
+
+static void traceReferences() {
+  while (vm.grayCount > 0) {
+    Obj* object = vm.grayStack[--vm.grayCount];
+    blackenObject(object);
+  }
+}
+
+static void sweep() {
+  Obj* previous = NULL;
+  Obj* object = vm.objects;
+  while (object != NULL) {
+    if (object->isMarked) {
+      object->isMarked = false;
+      previous = object;
+      object = object->next;
+    } else {
+      Obj* unreached = object;
+      object = object->next;
+      if (previous != NULL) {
+        previous->next = object;
+      } else {
+        vm.objects = object;
+      }
+
+      freeObject(unreached);
+    }
+  }
+}
+
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  // Shrinking the intern table allocates part way through.
+  vm.inMajorGC = true;
+
+  markRoots();
+  traceReferences();
+  stringSetRemoveWhite(&vm.strings);
+
+  int remembered = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    if (vm.remembered[i]->isMarked) {
+      vm.remembered[remembered++] = vm.remembered[i];
+    }
+  }
+  vm.rememberedCount = remembered;
+
+  sweep();
+
+  // Nursery objects are marked like any other but only reclaimed by a
+  // minor collection.
+  for (uint8_t* p = vm.nursery; p < vm.nurseryTop;) {
+    Obj* object = (Obj*)p;
+    object->isMarked = false;
+    p += NURSERY_ALIGN(objectSize(object));
+  }
+
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.inMajorGC = false;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated,
+         vm.nextGC);
+
+  int probes[4];
+  stringSetProbeHistogram(&vm.strings, probes, 4);
+  printf("   %d strings in %d slots, probes 1:%d 2:%d 3:%d 4+:%d\n",
+         vm.strings.count, vm.strings.capacity, probes[0], probes[1],
+         probes[2], probes[3]);
+#endif
+}
+
 void freeObjects() {
   Obj* object = vm.objects;
   while (object != NULL) {
@@ -53,4 +564,14 @@ void freeObjects() {
     freeObject(object);
     object = next;
   }
+
+  for (uint8_t* p = vm.nursery; p < vm.nurseryTop;) {
+    Obj* object = (Obj*)p;
+    p += NURSERY_ALIGN(objectSize(object));
+    finalizeYoung(object);
+  }
+
+  free(vm.nursery);
+  free(vm.remembered);
+  free(vm.grayStack);
 }
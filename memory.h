@@ -34,7 +34,21 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// New objects are bump-allocated in a fixed-size nursery. Objects that
+// survive a minor collection are copied into the old generation, which
+// is managed by reallocate() and the mark-sweep collector.
+#define NURSERY_SIZE (1024 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void freePools();
+void* allocateYoung(size_t size);
+void reserveYoung(size_t size);
+void writeBarrier(Obj* owner, Value value);
+void collectNursery();
+void markObject(Obj* object);
+void markValue(Value value);
+void collectGarbage();
 void freeObjects();
 
 #endif
@@ -14,8 +14,10 @@
    */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -23,10 +25,22 @@
 #include "table.h"
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = (Obj*)allocateYoung(size);
+  if (object != NULL) {
+    object->next = NULL;
+  } else {
+    object = (Obj*)reallocate(NULL, 0, size);
+    object->next = vm.objects;
+    vm.objects = object;
+  }
+
   object->type = type;
-  object->next = vm.objects;
-  vm.objects = object;
+  object->isMarked = false;
+  object->isRemembered = false;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
 
   return object;
 }
@@ -37,41 +51,147 @@ static Obj* allocateObject(size_t size, ObjType type) {
 ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, ObjTypeFunction);
   function->arity = 0;
+  function->maxStack = 0;
+#ifdef JIT
+  function->calls = 0;
+  function->jit = NULL;
+  function->traces = NULL;
+#endif
+#ifdef AOT
+  function->aot = NULL;
+#endif
   function->name = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
-  static ObjString* allocateString(char* chars, int length,
-                                 uint32_t hash) {ObjString* string = ALLOCATE_OBJ(ObjString, ObjTypeString);
-  string->length = length;
-  string->chars = chars;
+static ObjString* addString(ObjString* string, uint32_t hash) {
   string->hash = hash;
-  tableSet(&vm.strings, string, NIL_VAL);
+
+  push(OBJ_VAL(string));
+  stringSetAdd(&vm.strings, string);
+  pop();
   return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
+// Allocates a string with room for length characters in the same
+// block as the header. The caller fills in the characters and then
+// passes the string to internString() before using it as a value.
+ObjString* allocateString(int length) {
+  ObjString* string = (ObjString*)allocateObject(
+      sizeof(ObjString) + length + 1, ObjTypeString);
+  string->length = length;
+  string->chars[length] = '\0';
+  string->hash = 0;
+  return string;
+}
 
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
+ObjString* internString(ObjString* string) {
+  uint32_t hash = hashString(string->chars, string->length);
+  ObjString* interned = stringSetFind(&vm.strings, string->chars,
+                                      string->length, hash);
+  if (interned != NULL) return interned;
+
+  return addString(string, hash);
 }
 
 ObjString* copyString(const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
   
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
+  ObjString* interned = stringSetFind(&vm.strings, chars, length,
+                                      hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  return addString(string, hash);
+}
+
+ObjRope* newRope(Obj* left, Obj* right) {
+  ObjRope* rope = ALLOCATE_OBJ(ObjRope, ObjTypeRope);
+  rope->length = stringLength(left) + stringLength(right);
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+typedef void (*PieceFn)(ObjString* piece, void* context);
+
+// Visits the flat pieces of rope from left to right. The pending
+// right children live on the C heap so that walking a rope never
+// allocates from the managed heap.
+static void eachPiece(ObjRope* rope, PieceFn visit, void* context) {
+  Obj* inlineStack[32];
+  Obj** stack = inlineStack;
+  int capacity = 32;
+  int count = 0;
+
+  Obj* node = (Obj*)rope;
+  for (;;) {
+    ObjString* flat = flatString(node);
+    if (flat == NULL) {
+      ObjRope* inner = (ObjRope*)node;
+      if (count == capacity) {
+        capacity *= 2;
+        if (stack == inlineStack) {
+          stack = (Obj**)malloc(sizeof(Obj*) * capacity);
+          if (stack == NULL) exit(1);
+          memcpy(stack, inlineStack, sizeof(inlineStack));
+        } else {
+          stack = (Obj**)realloc(stack, sizeof(Obj*) * capacity);
+          if (stack == NULL) exit(1);
+        }
+      }
+      stack[count++] = inner->right;
+      node = inner->left;
+      continue;
+    }
+
+    visit(flat, context);
+    if (count == 0) break;
+    node = stack[--count];
+  }
+
+  if (stack != inlineStack) free(stack);
+}
+
+static void copyPiece(ObjString* piece, void* context) {
+  char** cursor = (char**)context;
+  memcpy(*cursor, piece->chars, piece->length);
+  *cursor += piece->length;
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  ObjString* string = allocateString(rope->length);
+  char* cursor = string->chars;
+  eachPiece(rope, copyPiece, &cursor);
+
+  rope->flat = internString(string);
+  rope->left = NULL;
+  rope->right = NULL;
+  writeBarrier((Obj*)rope, OBJ_VAL(rope->flat));
+  return rope->flat;
+}
+
+// Compares two strings or ropes by content. Both must be reachable
+// from the VM roots since flattening allocates.
+bool stringsEqual(Obj* a, Obj* b) {
+  if (a == b) return true;
+  if (stringLength(a) != stringLength(b)) return false;
+
+  ObjString* flatA = a->type == ObjTypeRope ?
+      flattenRope((ObjRope*)a) : (ObjString*)a;
+  ObjString* flatB = b->type == ObjTypeRope ?
+      flattenRope((ObjRope*)b) : (ObjString*)b;
+  return flatA == flatB;
+}
+
+static void printPiece(ObjString* piece, void* context) {
+  (void)context;
+  fwrite(piece->chars, 1, piece->length, stdout);
 }
 
 static void printFunction(ObjFunction* function) {
@@ -87,20 +207,11 @@ void printObject(Value value) {
     case ObjTypeString:
       printf("%s", AS_CSTRING(value));
       break;
+    case ObjTypeRope:
+      eachPiece(AS_ROPE(value), printPiece, NULL);
+      break;
     case ObjTypeFunction:
       printFunction(AS_FUNCTION(value));
       break;
   }
 }
-
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
-  }
-
-  return allocateString(chars, length, hash);
-}
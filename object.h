@@ -23,26 +23,59 @@
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
 #define IS_STRING(value)       isObjType(value, ObjTypeString)
+#define IS_ROPE(value)         isObjType(value, ObjTypeRope)
+#define IS_ANY_STRING(value)   (IS_STRING(value) || IS_ROPE(value))
 #define IS_FUNCTION(value)     isObjType(value, ObjTypeFunction)
 
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 
 typedef enum {
   ObjTypeFunction,
   ObjTypeString,
+  ObjTypeRope,
 } ObjType;
 
 
+// Objects in the old generation are linked through next. Objects in
+// the nursery are not linked; there next is NULL until a minor
+// collection promotes the object, after which it points at the
+// promoted copy.
 struct Obj {
   ObjType type;
+  bool isMarked;
+  bool isRemembered;
   struct Obj* next;
 };
 
+#ifdef AOT
+// Native code for a function, built by aotBuild(). Runs from the
+// instruction at offset and returns the offset the interpreter carries
+// on from, see aot.h.
+struct AotRuntime;
+typedef int (*AotFunction)(const struct AotRuntime* runtime,
+                           Value* constants, Value* globals,
+                           Value* slots, Value** stackTop, int offset);
+#endif
+
 typedef struct {
   Obj obj;
   int arity;
+  // The most values the function has on the stack at once, counting
+  // its own slot and its arguments.
+  int maxStack;
+#ifdef JIT
+  // Counts calls up to JIT_THRESHOLD, when jit is compiled.
+  int calls;
+  struct JitCode* jit;
+  struct Trace* traces;
+#endif
+#ifdef AOT
+  // Set when the function was loaded from a shared object.
+  AotFunction aot;
+#endif
   Chunk chunk;
   ObjString* name;
 } ObjFunction;
@@ -50,18 +83,46 @@ typedef struct {
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  char chars[];
 };
 
+// The unflattened concatenation of left and right, each an ObjString
+// or another ObjRope. The characters are only copied out, hashed and
+// interned when the rope is flattened, after which flat holds the
+// result and the children are released.
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;
+} ObjRope;
+
 ObjFunction* newFunction();
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+ObjString* allocateString(int length);
+ObjString* internString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
-ObjString* takeString(char* chars, int length);
+ObjRope* newRope(Obj* left, Obj* right);
+ObjString* flattenRope(ObjRope* rope);
+bool stringsEqual(Obj* a, Obj* b);
+
+static inline int stringLength(Obj* string) {
+  if (string->type == ObjTypeRope) return ((ObjRope*)string)->length;
+  return ((ObjString*)string)->length;
+}
+
+// Returns the flat string for string, or NULL if it is a rope that has
+// not been flattened yet.
+static inline ObjString* flatString(Obj* string) {
+  if (string->type == ObjTypeRope) return ((ObjRope*)string)->flat;
+  return (ObjString*)string;
+}
 
 void printObject(Value value);
 
@@ -0,0 +1,372 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#include <string.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+// Per-byte flags used while rewriting a chunk.
+#define FLAG_TARGET  0x1
+#define FLAG_REMOVED 0x2
+
+static bool isJump(uint8_t instruction) {
+  switch (instruction) {
+    case OpJumpIfFalse:
+    case OpJumpIfFalseLong:
+    case OpJumpIfFalsePop:
+    case OpJumpIfNotLessLocalConst:
+    case OpJumpIfNotLessLocalLocal:
+    case OpJump:
+    case OpJumpLong:
+    case OpLoop:
+    case OpLoopLong:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Conditional jumps only ever go forward.
+static bool isConditional(uint8_t instruction) {
+  switch (instruction) {
+    case OpJumpIfFalse:
+    case OpJumpIfFalseLong:
+    case OpJumpIfFalsePop:
+    case OpJumpIfNotLessLocalConst:
+    case OpJumpIfNotLessLocalLocal:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Conditional jumps that test the value on top of the stack and leave
+// it there when they jump.
+static bool testsTop(uint8_t instruction) {
+  return instruction == OpJumpIfFalse ||
+         instruction == OpJumpIfFalseLong ||
+         instruction == OpJumpIfFalsePop;
+}
+
+static bool isLong(uint8_t instruction) {
+  return instruction == OpJumpIfFalseLong || instruction == OpJumpLong ||
+         instruction == OpLoopLong;
+}
+
+// Whether control never falls through to the next instruction.
+static bool endsFlow(uint8_t instruction) {
+  return instruction == OpReturn || instruction == OpTailCall ||
+         (isJump(instruction) && !isConditional(instruction));
+}
+
+// Instructions that only push a value, so are dropped along with an
+// OpPop right after them.
+static bool isPurePush(uint8_t instruction) {
+  switch (instruction) {
+    case OpNil:
+    case OpTrue:
+    case OpFalse:
+    case OpConstant:
+    case OpConstantLong:
+    case OpGetLocal:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns whether the jump at offset can land on target without
+// changing its length.
+static bool canReach(Chunk* chunk, int offset, int target) {
+  uint8_t instruction = chunk->code[offset];
+  int end = offset + instructionLength(chunk, offset);
+  if (isConditional(instruction) && target < end) return false;
+
+  int distance = target > end ? target - end : end - target;
+  return distance <= (isLong(instruction) ? 0xffffff : UINT16_MAX);
+}
+
+// Rewrites the jump at the start of code, which ends at end, to land on
+// target. Unconditional jumps turn into loops and back as needed.
+static void writeJump(uint8_t* code, int length, int end, int target) {
+  uint8_t instruction = code[0];
+  bool wide = isLong(instruction);
+  int distance = target > end ? target - end : end - target;
+
+  if (!isConditional(instruction)) {
+    if (target < end) {
+      instruction = wide ? OpLoopLong : OpLoop;
+    } else {
+      instruction = wide ? OpJumpLong : OpJump;
+    }
+  }
+
+  code[0] = instruction;
+  uint8_t* operand = code + length;
+  if (wide) {
+    operand[-3] = (distance >> 16) & 0xff;
+    operand[-2] = (distance >> 8) & 0xff;
+    operand[-1] = distance & 0xff;
+  } else {
+    operand[-2] = (distance >> 8) & 0xff;
+    operand[-1] = distance & 0xff;
+  }
+}
+
+// Points jumps that land on another jump straight at where that one
+// goes. A jump that tests the top of the stack can also pass through
+// another one, since the value it tested is still there.
+static bool threadJumps(Chunk* chunk) {
+  bool changed = false;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (!isJump(instruction)) continue;
+
+    int original = jumpTarget(chunk, offset);
+    int target = original;
+    int best = original;
+    for (int hops = 0; target < chunk->count && hops < chunk->count;
+         hops++) {
+      uint8_t next = chunk->code[target];
+      bool follow = (isJump(next) && !isConditional(next)) ||
+                    (testsTop(next) && testsTop(instruction));
+      if (!follow || target == offset) break;
+
+      target = jumpTarget(chunk, target);
+      if (canReach(chunk, offset, target)) best = target;
+    }
+
+    if (best != original) {
+      int length = instructionLength(chunk, offset);
+      writeJump(chunk->code + offset, length, offset + length, best);
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+// Returns the offsets of the count instructions starting at offset in
+// starts, or false if they run off the chunk or a jump lands on any but
+// the first.
+static bool sequenceAt(Chunk* chunk, uint8_t* flags, int offset,
+                       int* starts, int count) {
+  for (int i = 0; i < count; i++) {
+    if (offset >= chunk->count) return false;
+    if (i > 0 && (flags[offset] & FLAG_TARGET)) return false;
+    starts[i] = offset;
+    offset += instructionLength(chunk, offset);
+  }
+  starts[count] = offset;
+  return true;
+}
+
+// Replaces the sequence at offset with a superinstruction if it matches
+// one. The superinstruction is written over the start of the sequence
+// and the rest of its bytes are marked removed. Returns where the
+// sequence ended, or -1 if nothing was fused.
+static int fuse(Chunk* chunk, uint8_t* flags, int offset) {
+  uint8_t* code = chunk->code;
+  int at[6];
+
+  // GetLocal, GetLocal or Constant, Less, JumpIfFalse and Pop, as in a
+  // loop condition. The jump lands on an OpPop for the condition, which
+  // the fused jump skips since it leaves nothing on the stack.
+  if (code[offset] == OpGetLocal && sequenceAt(chunk, flags, offset, at, 5) &&
+      (code[at[1]] == OpGetLocal || code[at[1]] == OpConstant) &&
+      code[at[2]] == OpLess && code[at[3]] == OpJumpIfFalse &&
+      code[at[4]] == OpPop) {
+    int target = jumpTarget(chunk, at[3]) + 1;
+    int distance = target - (offset + 5);
+    if (target <= chunk->count && code[target - 1] == OpPop &&
+        distance <= UINT16_MAX) {
+      uint8_t slot = code[offset + 1];
+      uint8_t operand = code[at[1] + 1];
+      code[offset] = code[at[1]] == OpGetLocal
+          ? OpJumpIfNotLessLocalLocal : OpJumpIfNotLessLocalConst;
+      code[offset + 1] = slot;
+      code[offset + 2] = operand;
+      writeJump(code + offset, 5, offset + 5, target);
+      for (int i = offset + 5; i < at[5]; i++) flags[i] |= FLAG_REMOVED;
+      flags[target] |= FLAG_TARGET;
+      return at[5];
+    }
+  }
+
+  // GetLocal, Constant and Add, as in 'i + 1'.
+  if (code[offset] == OpGetLocal && sequenceAt(chunk, flags, offset, at, 3) &&
+      code[at[1]] == OpConstant && code[at[2]] == OpAdd) {
+    uint8_t slot = code[offset + 1];
+    uint8_t constant = code[at[1] + 1];
+    code[offset] = OpAddLocalConst;
+    code[offset + 1] = slot;
+    code[offset + 2] = constant;
+    for (int i = offset + 3; i < at[3]; i++) flags[i] |= FLAG_REMOVED;
+    return at[3];
+  }
+
+  // JumpIfFalse and Pop, at the top of every if and while.
+  if (code[offset] == OpJumpIfFalse &&
+      sequenceAt(chunk, flags, offset, at, 2) && code[at[1]] == OpPop) {
+    code[offset] = OpJumpIfFalsePop;
+    flags[at[1]] |= FLAG_REMOVED;
+    return at[2];
+  }
+
+  return -1;
+}
+
+// Marks the bytes to drop, fusing instructions in place as it goes.
+static bool markRemovals(Chunk* chunk, uint8_t* flags) {
+  bool changed = false;
+  int offset = 0;
+  while (offset < chunk->count) {
+    uint8_t instruction = chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+
+    bool onlyJumps = isJump(instruction) &&
+        (!isConditional(instruction) || instruction == OpJumpIfFalse ||
+         instruction == OpJumpIfFalseLong);
+    if (onlyJumps && jumpTarget(chunk, offset) == next) {
+      // Lands on the next instruction whichever way it goes.
+      for (int i = offset; i < next; i++) flags[i] |= FLAG_REMOVED;
+      offset = next;
+      changed = true;
+      continue;
+    }
+
+    if (endsFlow(instruction)) {
+      // Nothing reaches the code after this until a jump lands on it.
+      int end = next;
+      while (end < chunk->count && !(flags[end] & FLAG_TARGET)) {
+        end += instructionLength(chunk, end);
+      }
+      for (int i = next; i < end; i++) flags[i] |= FLAG_REMOVED;
+      changed = changed || end > next;
+      offset = end;
+      continue;
+    }
+
+    int fused = fuse(chunk, flags, offset);
+    if (fused != -1) {
+      offset = fused;
+      changed = true;
+      continue;
+    }
+
+    if (next >= chunk->count || (flags[next] & FLAG_TARGET)) {
+      offset = next;
+      continue;
+    }
+
+    uint8_t following = chunk->code[next];
+    int after = next + instructionLength(chunk, next);
+    uint8_t replacement = instruction;
+    if (following == OpNot) {
+      switch (instruction) {
+        case OpEq:      replacement = OpNotEq; break;
+        // These keep the result of OpLess/OpGreater and OpNot for NaN.
+        case OpLess:    replacement = OpGreaterEq; break;
+        case OpGreater: replacement = OpLessEq; break;
+        default: break;
+      }
+    }
+
+    if (replacement != instruction) {
+      chunk->code[offset] = replacement;
+      flags[next] |= FLAG_REMOVED;
+      changed = true;
+      offset = after;
+    } else if (instruction == OpPrint && following == OpPop) {
+      // A print statement, whose nil nothing uses.
+      chunk->code[offset] = OpPrintPop;
+      flags[next] |= FLAG_REMOVED;
+      changed = true;
+      offset = after;
+    } else if (isPurePush(instruction) && following == OpPop) {
+      for (int i = offset; i < after; i++) flags[i] |= FLAG_REMOVED;
+      changed = true;
+      offset = after;
+    } else {
+      offset = next;
+    }
+  }
+
+  return changed;
+}
+
+// Drops the removed bytes from the code and line table and re-encodes
+// every jump for the new layout. Removing code only ever shortens a
+// jump, so each one keeps its length.
+static void compact(Chunk* chunk, uint8_t* flags) {
+  int count = chunk->count;
+  int* moved = ALLOCATE(int, count + 1);
+  int kept = 0;
+  for (int offset = 0; offset < count; offset++) {
+    moved[offset] = kept;
+    if (!(flags[offset] & FLAG_REMOVED)) kept++;
+  }
+  moved[count] = kept;
+
+  int offset = 0;
+  while (offset < count) {
+    // Fused instructions leave removed bytes that aren't instructions,
+    // so those are skipped one at a time.
+    if (flags[offset] & FLAG_REMOVED) {
+      offset++;
+      continue;
+    }
+
+    int length = instructionLength(chunk, offset);
+    int to = moved[offset];
+    int target = isJump(chunk->code[offset])
+        ? jumpTarget(chunk, offset) : -1;
+    memmove(chunk->code + to, chunk->code + offset, length);
+    memmove(chunk->lines + to, chunk->lines + offset,
+            sizeof(int) * length);
+    if (target != -1) {
+      writeJump(chunk->code + to, length, to + length, moved[target]);
+    }
+    offset += length;
+  }
+
+  FREE_ARRAY(int, moved, count + 1);
+  chunk->count = kept;
+}
+
+void optimizeChunk(Chunk* chunk) {
+  bool changed = true;
+  while (changed) {
+    changed = threadJumps(chunk);
+
+    int count = chunk->count;
+    uint8_t* flags = ALLOCATE(uint8_t, count + 1);
+    memset(flags, 0, count + 1);
+    for (int offset = 0; offset < count;
+         offset += instructionLength(chunk, offset)) {
+      if (isJump(chunk->code[offset])) {
+        flags[jumpTarget(chunk, offset)] |= FLAG_TARGET;
+      }
+    }
+
+    if (markRemovals(chunk, flags)) {
+      compact(chunk, flags);
+      changed = true;
+    }
+    FREE_ARRAY(uint8_t, flags, count + 1);
+  }
+}
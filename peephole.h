@@ -0,0 +1,26 @@
+/*
+   Copyright 2021 Devin Rockwell
+   This file is part of MTI
+   MTI is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+   */
+
+#ifndef mti_peephole_h
+#define mti_peephole_h
+
+#include "chunk.h"
+
+// Rewrites short instruction sequences in a finished chunk into cheaper
+// ones and removes code that has no effect, keeping jumps and the line
+// table in step.
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -1,105 +1,286 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
+// Tables shrink once fewer than this fraction of slots are live.
+#define TABLE_MIN_LOAD 0.25
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+
+typedef uint32_t GroupMask;
+
+// Returns a bit mask of the slots in the group starting at control
+// whose control byte equals byte.
+static inline GroupMask matchByte(const uint8_t* control, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i*)control);
+  __m128i match = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte));
+  return (GroupMask)_mm_movemask_epi8(match);
+#else
+  GroupMask mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    if (control[i] == byte) mask |= (GroupMask)1 << i;
+  }
+  return mask;
+#endif
+}
+
+// Returns a mask of the slots that are empty or deleted.
+static inline GroupMask matchFree(const uint8_t* control) {
+#ifdef __SSE2__
+  // Only TABLE_EMPTY and TABLE_DELETED have the high bit set.
+  __m128i group = _mm_loadu_si128((const __m128i*)control);
+  return (GroupMask)_mm_movemask_epi8(group);
+#else
+  GroupMask mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    if (control[i] & 0x80) mask |= (GroupMask)1 << i;
+  }
+  return mask;
+#endif
+}
+
+static inline int lowestBit(GroupMask mask) {
+  return __builtin_ctz(mask);
+}
+
+// Groups are visited with triangular steps, which reaches every group
+// once when the group count is a power of two.
+#define FOR_EACH_GROUP(capacity, hash, group) \
+    for (uint32_t groupMask_ = (uint32_t)(capacity) / \
+             TABLE_GROUP_WIDTH - 1, \
+         step_ = 0, \
+         group = (H1(hash) / TABLE_GROUP_WIDTH) & groupMask_; ; \
+         step_++, group = (group + step_) & groupMask_)
 
 void initTable(Table* table) {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
+  table->control = NULL;
   table->entries = NULL;
 }
 
 void freeTable(Table* table) {
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
   FREE_ARRAY(Entry, table->entries, table->capacity);
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity,
-                        ObjString* key) {
-  uint32_t index = key->hash % capacity;
-  Entry* tombstone = NULL;
-  for (;;) {
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
+// Returns the slot holding key, or -1.
+static int findSlot(uint8_t* control, Entry* entries, int capacity,
+                    ObjString* key) {
+  FOR_EACH_GROUP(capacity, key->hash, group) {
+    int base = group * TABLE_GROUP_WIDTH;
+    GroupMask match = matchByte(control + base, H2(key->hash));
+    while (match != 0) {
+      int slot = base + lowestBit(match);
+      if (entries[slot].key == key) return slot;
+      match &= match - 1;
     }
-    index = (index + 1) % capacity;
+
+    if (matchByte(control + base, TABLE_EMPTY) != 0) return -1;
+  }
+}
+
+// Returns the first empty or deleted slot on hash's probe sequence.
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash) {
+  FOR_EACH_GROUP(capacity, hash, group) {
+    int base = group * TABLE_GROUP_WIDTH;
+    GroupMask free = matchFree(control + base);
+    if (free != 0) return base + lowestBit(free);
   }
 }
 
 static void adjustCapacity(Table* table, int capacity) {
+  uint8_t* control = ALLOCATE(uint8_t, capacity);
   Entry* entries = ALLOCATE(Entry, capacity);
+  memset(control, TABLE_EMPTY, capacity);
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
     entries[i].value = NIL_VAL;
   }
 
-  table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
     if (entry->key == NULL) continue;
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    int slot = findFreeSlot(control, capacity, entry->key->hash);
+    control[slot] = H2(entry->key->hash);
+    entries[slot] = *entry;
   }
 
+  table->tombstones = 0;
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
   FREE_ARRAY(Entry, table->entries, table->capacity);
+  table->control = control;
   table->entries = entries;
   table->capacity = capacity;
 }
 
+// Slots are a key followed, for tables, by a value. These helpers only
+// look at the key so they serve both Table and StringSet.
+#define SLOT_KEY(slots, slotSize, index) \
+    (*(ObjString**)((char*)(slots) + (size_t)(index) * (slotSize)))
+
+// Clears out the tombstones without reallocating. Every live slot is
+// first marked pending with TABLE_DELETED, which findFreeSlot() treats
+// as free, and is then moved to the first free slot on its probe
+// sequence. Displacing a pending slot swaps it into the slot just
+// vacated to be placed next.
+static void dropTombstones(uint8_t* control, void* slots,
+                           size_t slotSize, int capacity) {
+  char* bytes = (char*)slots;
+  char displaced[sizeof(Entry)];
+
+  for (int i = 0; i < capacity; i++) {
+    control[i] = SLOT_KEY(slots, slotSize, i) == NULL
+        ? TABLE_EMPTY : TABLE_DELETED;
+  }
+
+  for (int i = 0; i < capacity; i++) {
+    if (control[i] != TABLE_DELETED) continue;
+
+    uint32_t hash = SLOT_KEY(slots, slotSize, i)->hash;
+    int slot = findFreeSlot(control, capacity, hash);
+
+    // Lookups reach either slot in the same group, so it can stay put.
+    if (slot / TABLE_GROUP_WIDTH == i / TABLE_GROUP_WIDTH) {
+      control[i] = H2(hash);
+      continue;
+    }
+
+    bool wasPending = control[slot] == TABLE_DELETED;
+    memcpy(displaced, bytes + slot * slotSize, slotSize);
+    memcpy(bytes + slot * slotSize, bytes + i * slotSize, slotSize);
+    memcpy(bytes + i * slotSize, displaced, slotSize);
+    control[slot] = H2(hash);
+
+    if (wasPending) {
+      i--;
+    } else {
+      control[i] = TABLE_EMPTY;
+    }
+  }
+}
+
+// Returns the capacity a table holding count entries should shrink to,
+// which is capacity itself if it's dense enough.
+static int shrunkCapacity(int count, int capacity) {
+  while (capacity > TABLE_GROUP_WIDTH && count < capacity * TABLE_MIN_LOAD) {
+    capacity /= 2;
+  }
+  return capacity;
+}
+
+// Marks slot unused and returns whether it had to become a tombstone.
+static bool releaseSlot(uint8_t* control, int slot) {
+  // A group that still has an empty slot has never been full since the
+  // last rehash, so no probe sequence continues past it and the slot
+  // can be emptied outright.
+  int base = slot - slot % TABLE_GROUP_WIDTH;
+  if (matchByte(control + base, TABLE_EMPTY) != 0) {
+    control[slot] = TABLE_EMPTY;
+    return false;
+  }
+
+  control[slot] = TABLE_DELETED;
+  return true;
+}
+
+static void probeHistogram(void* slots, size_t slotSize, int capacity,
+                           int* counts, int buckets) {
+  for (int i = 0; i < buckets; i++) counts[i] = 0;
+
+  for (int i = 0; i < capacity; i++) {
+    ObjString* key = SLOT_KEY(slots, slotSize, i);
+    if (key == NULL) continue;
+
+    int probes = 1;
+    FOR_EACH_GROUP(capacity, key->hash, group) {
+      if (group == (uint32_t)(i / TABLE_GROUP_WIDTH)) break;
+      probes++;
+    }
+    counts[(probes < buckets ? probes : buckets) - 1]++;
+  }
+}
+
+static void shrinkIfSparse(Table* table) {
+  int capacity = shrunkCapacity(table->count, table->capacity);
+  if (capacity != table->capacity) adjustCapacity(table, capacity);
+}
+
+static void removeSlot(Table* table, int slot) {
+  if (releaseSlot(table->control, slot)) table->tombstones++;
+  table->entries[slot].key = NULL;
+  table->entries[slot].value = NIL_VAL;
+  table->count--;
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
   if (table->count == 0) return false;
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int slot = findSlot(table->control, table->entries, table->capacity,
+                      key);
+  if (slot == -1) return false;
 
-  *value = entry->value;
+  *value = table->entries[slot].value;
   return true;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  if (table->capacity > 0) {
+    int slot = findSlot(table->control, table->entries,
+                        table->capacity, key);
+    if (slot != -1) {
+      table->entries[slot].value = value;
+      return false;
+    }
   }
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
+  if (table->count + table->tombstones + 1 >
+      table->capacity * TABLE_MAX_LOAD) {
+    if (table->tombstones > table->count) {
+      // Mostly tombstones, so there's room once they're gone.
+      dropTombstones(table->control, table->entries, sizeof(Entry),
+                     table->capacity);
+      table->tombstones = 0;
+    } else {
+      int capacity = table->capacity < TABLE_GROUP_WIDTH
+          ? TABLE_GROUP_WIDTH : table->capacity * 2;
+      adjustCapacity(table, capacity);
+    }
+  }
+
+  int slot = findFreeSlot(table->control, table->capacity, key->hash);
+  if (table->control[slot] == TABLE_DELETED) table->tombstones--;
+  table->count++;
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  table->control[slot] = H2(key->hash);
+  table->entries[slot].key = key;
+  table->entries[slot].value = value;
+  return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
   if (table->count == 0) return false;
 
-  // Find the entry.
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
-
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  int slot = findSlot(table->control, table->entries, table->capacity,
+                      key);
+  if (slot == -1) return false;
 
+  removeSlot(table, slot);
+  shrinkIfSparse(table);
   return true;
 }
 
@@ -112,23 +293,161 @@ void tableAddAll(Table* from, Table* to) {
   }
 }
 
-ObjString* tableFindString(Table* table, const char* chars,
-                           int length, uint32_t hash) {
-  if (table->count == 0) return NULL;
+void markTable(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    markObject((Obj*)entry->key);
+    markValue(entry->value);
+  }
+}
+
+// Counts how many groups a lookup of each live key has to look at.
+// counts[n] is the number of keys found in group n + 1 of their probe
+// sequence, with longer probes added to the last bucket.
+void tableProbeHistogram(Table* table, int* counts, int buckets) {
+  probeHistogram(table->entries, sizeof(Entry), table->capacity, counts,
+                 buckets);
+}
+
+void initStringSet(StringSet* set) {
+  set->count = 0;
+  set->tombstones = 0;
+  set->capacity = 0;
+  set->control = NULL;
+  set->strings = NULL;
+}
+
+void freeStringSet(StringSet* set) {
+  FREE_ARRAY(uint8_t, set->control, set->capacity);
+  FREE_ARRAY(ObjString*, set->strings, set->capacity);
+  initStringSet(set);
+}
 
-  uint32_t index = hash % table->capacity;
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-        entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+static int findMember(StringSet* set, ObjString* string) {
+  FOR_EACH_GROUP(set->capacity, string->hash, group) {
+    int base = group * TABLE_GROUP_WIDTH;
+    GroupMask match = matchByte(set->control + base, H2(string->hash));
+    while (match != 0) {
+      int slot = base + lowestBit(match);
+      if (set->strings[slot] == string) return slot;
+      match &= match - 1;
     }
 
-    index = (index + 1) % table->capacity;
+    if (matchByte(set->control + base, TABLE_EMPTY) != 0) return -1;
   }
 }
+
+static void resizeStringSet(StringSet* set, int capacity) {
+  uint8_t* control = ALLOCATE(uint8_t, capacity);
+  ObjString** strings = ALLOCATE(ObjString*, capacity);
+  memset(control, TABLE_EMPTY, capacity);
+  for (int i = 0; i < capacity; i++) strings[i] = NULL;
+
+  for (int i = 0; i < set->capacity; i++) {
+    ObjString* string = set->strings[i];
+    if (string == NULL) continue;
+
+    int slot = findFreeSlot(control, capacity, string->hash);
+    control[slot] = H2(string->hash);
+    strings[slot] = string;
+  }
+
+  set->tombstones = 0;
+  FREE_ARRAY(uint8_t, set->control, set->capacity);
+  FREE_ARRAY(ObjString*, set->strings, set->capacity);
+  set->control = control;
+  set->strings = strings;
+  set->capacity = capacity;
+}
+
+static void shrinkSetIfSparse(StringSet* set) {
+  int capacity = shrunkCapacity(set->count, set->capacity);
+  if (capacity != set->capacity) resizeStringSet(set, capacity);
+}
+
+static void removeMember(StringSet* set, int slot) {
+  if (releaseSlot(set->control, slot)) set->tombstones++;
+  set->strings[slot] = NULL;
+  set->count--;
+}
+
+ObjString* stringSetFind(StringSet* set, const char* chars, int length,
+                         uint32_t hash) {
+  if (set->count == 0) return NULL;
+
+  FOR_EACH_GROUP(set->capacity, hash, group) {
+    int base = group * TABLE_GROUP_WIDTH;
+    GroupMask match = matchByte(set->control + base, H2(hash));
+    while (match != 0) {
+      ObjString* string = set->strings[base + lowestBit(match)];
+      if (string->length == length && string->hash == hash &&
+          memcmp(string->chars, chars, length) == 0) {
+        return string;
+      }
+      match &= match - 1;
+    }
+
+    if (matchByte(set->control + base, TABLE_EMPTY) != 0) return NULL;
+  }
+}
+
+// Adds a string that isn't in the set yet.
+void stringSetAdd(StringSet* set, ObjString* string) {
+  if (set->count + set->tombstones + 1 > set->capacity * TABLE_MAX_LOAD) {
+    if (set->tombstones > set->count) {
+      dropTombstones(set->control, set->strings, sizeof(ObjString*),
+                     set->capacity);
+      set->tombstones = 0;
+    } else {
+      int capacity = set->capacity < TABLE_GROUP_WIDTH
+          ? TABLE_GROUP_WIDTH : set->capacity * 2;
+      resizeStringSet(set, capacity);
+    }
+  }
+
+  int slot = findFreeSlot(set->control, set->capacity, string->hash);
+  if (set->control[slot] == TABLE_DELETED) set->tombstones--;
+  set->count++;
+
+  set->control[slot] = H2(string->hash);
+  set->strings[slot] = string;
+}
+
+bool stringSetDelete(StringSet* set, ObjString* string) {
+  if (set->count == 0) return false;
+
+  int slot = findMember(set, string);
+  if (slot == -1) return false;
+
+  removeMember(set, slot);
+  shrinkSetIfSparse(set);
+  return true;
+}
+
+// Swaps a member for a copy of it with the same hash, which keeps its
+// slot.
+bool stringSetRelocate(StringSet* set, ObjString* from, ObjString* to) {
+  if (set->count == 0) return false;
+
+  int slot = findMember(set, from);
+  if (slot == -1) return false;
+
+  set->strings[slot] = to;
+  return true;
+}
+
+void stringSetRemoveWhite(StringSet* set) {
+  for (int i = 0; i < set->capacity; i++) {
+    ObjString* string = set->strings[i];
+    if (string != NULL && !string->obj.isMarked) removeMember(set, i);
+  }
+
+  // Resizing while walking the slots would skip some, so wait until
+  // the end.
+  shrinkSetIfSparse(set);
+}
+
+void stringSetProbeHistogram(StringSet* set, int* counts, int buckets) {
+  probeHistogram(set->strings, sizeof(ObjString*), set->capacity, counts,
+                 buckets);
+}
@@ -10,9 +10,20 @@ typedef struct {
   Value value;
 } Entry;
 
+// Open addressing over groups of TABLE_GROUP_WIDTH slots. Each slot has
+// a control byte: TABLE_EMPTY, TABLE_DELETED, or the low 7 bits of the
+// key's hash when the slot is in use. A lookup compares a whole group
+// of control bytes at once and only touches the entries whose byte
+// matches. Unused slots always have a NULL key.
+#define TABLE_GROUP_WIDTH 16
+#define TABLE_EMPTY   ((uint8_t)0x80)
+#define TABLE_DELETED ((uint8_t)0xfe)
+
 typedef struct {
   int count;
+  int tombstones;
   int capacity;
+  uint8_t* control;
   Entry* entries;
 } Table;
 
@@ -22,7 +33,28 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
-ObjString* tableFindString(Table* table, const char* chars,
-                           int length, uint32_t hash);
+void markTable(Table* table);
+void tableProbeHistogram(Table* table, int* counts, int buckets);
+
+// A set of strings laid out like a Table without the values, used to
+// intern strings. The control byte doubles as the cached hash fragment
+// that filters candidates before their characters are compared.
+typedef struct {
+  int count;
+  int tombstones;
+  int capacity;
+  uint8_t* control;
+  ObjString** strings;
+} StringSet;
+
+void initStringSet(StringSet* set);
+void freeStringSet(StringSet* set);
+ObjString* stringSetFind(StringSet* set, const char* chars, int length,
+                         uint32_t hash);
+void stringSetAdd(StringSet* set, ObjString* string);
+bool stringSetDelete(StringSet* set, ObjString* string);
+bool stringSetRelocate(StringSet* set, ObjString* from, ObjString* to);
+void stringSetRemoveWhite(StringSet* set);
+void stringSetProbeHistogram(StringSet* set, int* counts, int buckets);
 
 #endif
@@ -44,6 +44,19 @@ void freeValueArray(ValueArray* array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  } else if (IS_UNDEFINED(value)) {
+    printf("undefined");
+  }
+#else
   switch (value.type) {
     case ValBool:
       printf(AS_BOOL(value) ? "true" : "false");
@@ -51,16 +64,35 @@ void printValue(Value value) {
     case ValNil: printf("nil"); break;
     case ValNum: printf("%g", AS_NUMBER(value)); break;
     case ValObj: printObject(value); break;
+    case ValUndefined: printf("undefined"); break;
   }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  if (a == b) return true;
+  if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+    return stringsEqual(AS_OBJ(a), AS_OBJ(b));
+  }
+  return false;
+#else
   if (a.type != b.type) return false;
   switch (a.type) {
     case ValBool:   return AS_BOOL(a) == AS_BOOL(b);
     case ValNil:    return true;
+    case ValUndefined: return true;
     case ValNum: return AS_NUMBER(a) == AS_NUMBER(b);
-    case ValObj: return AS_OBJ(a) == AS_OBJ(b);
+    case ValObj:
+      if (AS_OBJ(a) == AS_OBJ(b)) return true;
+      if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+        return stringsEqual(AS_OBJ(a), AS_OBJ(b));
+      }
+      return false;
     default:         return false; // Unreachable.
   }
+#endif
 }
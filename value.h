@@ -16,16 +16,66 @@
 #ifndef mti_value_h
 #define mti_value_h
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value) \
+    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   ValBool,
   ValNil,
   ValNum,
   ValObj,
+  ValUndefined,
 } ValueType;
 
 
@@ -43,9 +93,11 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == ValNil)
 #define IS_NUMBER(value)  ((value).type == ValNum)
 #define IS_OBJ(value)     ((value).type == ValObj)
+#define IS_UNDEFINED(value) ((value).type == ValUndefined)
 
 #define BOOL_VAL(value)   ((Value){ValBool, {.boolean = value}})
 #define NIL_VAL           ((Value){ValNil, {.number = 0}})
+#define UNDEFINED_VAL     ((Value){ValUndefined, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){ValNum, {.number = value}})
 #define OBJ_VAL(object)   ((Value){ValObj, {.obj = (Obj*)object}})
 
@@ -53,6 +105,8 @@ typedef struct {
 #define AS_NUMBER(value)  ((value).as.number)
 #define AS_OBJ(value)     ((value).as.obj)
 
+#endif
+
 typedef struct {
   int capacity;
   int count;
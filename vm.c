@@ -20,6 +20,9 @@
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "hash.h"
+#include "aot.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
 #include <string.h>
@@ -28,7 +31,6 @@ VM vm;
 
 static void resetStack() {
   vm.stackTop = vm.stack;
-  vm.localStackTop = vm.localStack;
   vm.frameCount = 0;
 }
 
@@ -39,8 +41,12 @@ static void runtimeError(const char* format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
-  
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    if (i == vm.frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+      fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES - 1;
+    }
+
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
@@ -57,16 +63,56 @@ static void runtimeError(const char* format, ...) {
 }
 
 void initVM() {
+  initHashSeed();
+  vm.frames = NULL;
+  vm.frameCapacity = 0;
+  vm.stack = NULL;
+  vm.stackCapacity = 0;
   resetStack();
   vm.objects = NULL;
+  vm.bytesAllocated = 0;
+  vm.nextGC = 1024 * 1024;
+  vm.inMajorGC = false;
+
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+
+  vm.nursery = NULL;
+  vm.nurseryTop = NULL;
+  vm.nurseryEnd = NULL;
+  vm.inMinorGC = false;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+
   initTable(&vm.globals);
-  initTable(&vm.strings);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
+  initStringSet(&vm.strings);
+#ifdef JIT
+  for (int i = 0; i < HOT_LOOPS; i++) vm.hotLoops[i] = HOT_LOOP_THRESHOLD;
+#endif
+
+  vm.frames = GROW_ARRAY(CallFrame, NULL, 0, FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.stack = GROW_ARRAY(Value, NULL, 0, STACK_INITIAL);
+  vm.stackCapacity = STACK_INITIAL;
+  resetStack();
 }
 
 void freeVM() {
   freeTable(&vm.globals);
-  freeTable(&vm.strings);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
+  freeStringSet(&vm.strings);
+  FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
   freeObjects();
+  freePools();
+#ifdef DEBUG_PROFILE_PAIRS
+  printPairProfile();
+#endif
 }
 
 void push(Value value) {
@@ -79,37 +125,95 @@ Value pop() {
   return *vm.stackTop;
 }
 
+// Grows the stack so that it holds at least capacity values. Growing
+// can move it, so every pointer into it is moved along. Each one is
+// fixed up before the next allocation, which may collect and walk the
+// stack.
+static void reserveStack(int capacity) {
+  if (capacity <= vm.stackCapacity) return;
+
+  int oldCapacity = vm.stackCapacity;
+  int newCapacity = oldCapacity;
+  while (newCapacity < capacity) newCapacity = GROW_CAPACITY(newCapacity);
+
+  Value* oldStack = vm.stack;
+  vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, newCapacity);
+  vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+  }
 
-void localPush(Value value) {
-  *vm.localStackTop = value;
-  vm.localStackTop++;
-}
-
-Value localPop() {
-  vm.localStackTop--;
-  return *vm.localStackTop;
+  vm.stackCapacity = newCapacity;
 }
 
-static Value peek(int distance) {
-  return vm.stackTop[-1 - distance];
+// Makes room on the stack for function to run with its slots starting
+// at slots, an index into the stack.
+static void reserveFrameStack(ObjFunction* function, int slots) {
+  reserveStack(slots + function->maxStack + STACK_RESERVE);
 }
 
-static bool call(ObjFunction* function, int argCount) {
+static bool checkArity(ObjFunction* function, int argCount) {
   if (argCount != function->arity) {
     runtimeError("Expected %d arguments but got %d.",
         function->arity, argCount);
     return false;
   }
+  return true;
+}
+
+static bool call(ObjFunction* function, int argCount) {
+  if (!checkArity(function, argCount)) return false;
 
   if (vm.frameCount == FRAMES_MAX) {
     runtimeError("Stack overflow.");
     return false;
   }
 
+  if (vm.frameCount == vm.frameCapacity) {
+    int oldCapacity = vm.frameCapacity;
+    vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity,
+                           vm.frameCapacity);
+  }
+
+  reserveFrameStack(function,
+                    (int)(vm.stackTop - vm.stack) - argCount - 1);
+
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->function = function;
   frame->ip = function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+#ifdef JIT
+  if (++function->calls == JIT_THRESHOLD) jitCompile(function);
+#endif
+  return true;
+}
+
+// Runs the callee in place of the current call, whose result would
+// only be returned. The callee and its arguments slide down over the
+// current frame's slots, so a chain of tail calls uses one frame.
+static bool tailCall(int argCount) {
+  Value callee = vm.stackTop[-1 - argCount];
+  if (!IS_OBJ(callee) || OBJ_TYPE(callee) != ObjTypeFunction) {
+    runtimeError("Can only call functions and classes.");
+    return false;
+  }
+
+  ObjFunction* function = AS_FUNCTION(callee);
+  if (!checkArity(function, argCount)) return false;
+
+  reserveFrameStack(function,
+      (int)(vm.frames[vm.frameCount - 1].slots - vm.stack));
+
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->function = function;
+  frame->ip = function->chunk.code;
+#ifdef JIT
+  if (++function->calls == JIT_THRESHOLD) jitCompile(function);
+#endif
   return true;
 }
 
@@ -131,203 +235,720 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
-
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+// Short results are built and interned right away. Longer ones become
+// a rope node so that building a string piece by piece doesn't copy
+// and rehash the prefix on every step.
+void concatenate() {
+  int length = stringLength(AS_OBJ(vm.stackTop[-1])) +
+               stringLength(AS_OBJ(vm.stackTop[-2]));
+  bool flat = length < ROPE_MIN_LENGTH &&
+              flatString(AS_OBJ(vm.stackTop[-1])) != NULL &&
+              flatString(AS_OBJ(vm.stackTop[-2])) != NULL;
+  reserveYoung(flat ? sizeof(ObjString) + length + 1
+                    : sizeof(ObjRope));
+
+  Obj* result;
+  if (flat) {
+    ObjString* b = flatString(AS_OBJ(vm.stackTop[-1]));
+    ObjString* a = flatString(AS_OBJ(vm.stackTop[-2]));
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    result = (Obj*)internString(string);
+  } else {
+    Obj* b = AS_OBJ(vm.stackTop[-1]);
+    Obj* a = AS_OBJ(vm.stackTop[-2]);
+    if (flatString(a) != NULL) a = (Obj*)flatString(a);
+    if (flatString(b) != NULL) b = (Obj*)flatString(b);
+    result = (Obj*)newRope(a, b);
+  }
 
-  ObjString* result = takeString(chars, length);
+  pop();
+  pop();
   push(OBJ_VAL(result));
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame* frame) {
+  printf("          ");
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassembleInstruction(&frame->function->chunk,
+      (int)(frame->ip - frame->function->chunk.code));
+}
+#endif
+
+// Joins the top count values, all strings or ropes. Consecutive flat
+// operands are copied into a single string as long as the result stays
+// below ROPE_MIN_LENGTH; the remaining groups are then joined into
+// ropes. Every intermediate result is kept in a stack slot.
+void concatenateN(int count) {
+  Value* operands = vm.stackTop - count;
+  int groups = 0;
+  int start = 0;
+  while (start < count) {
+    int end = start;
+    int length = 0;
+    while (end < count) {
+      Obj* operand = AS_OBJ(operands[end]);
+      int next = length + stringLength(operand);
+      if (flatString(operand) == NULL ||
+          (end > start && next >= ROPE_MIN_LENGTH)) {
+        break;
+      }
+      length = next;
+      end++;
+    }
+
+    if (end - start > 1) {
+      reserveYoung(sizeof(ObjString) + length + 1);
+      ObjString* string = allocateString(length);
+      char* cursor = string->chars;
+      for (int i = start; i < end; i++) {
+        ObjString* piece = flatString(AS_OBJ(operands[i]));
+        memcpy(cursor, piece->chars, piece->length);
+        cursor += piece->length;
+      }
+      operands[groups] = OBJ_VAL(internString(string));
+    } else {
+      if (end == start) end++;
+      operands[groups] = operands[start];
+    }
+
+    groups++;
+    start = end;
+  }
+
+  vm.stackTop = operands + groups;
+  while (groups > 1) {
+    concatenate();
+    groups--;
+  }
+}
+
 static InterpretResult run() {
   CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  register uint8_t* ip = frame->ip;
+  register Value* constants = frame->function->chunk.constants.values;
+  register Value* stackTop = vm.stackTop;
+  uint8_t instruction;
 
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define GLOBAL_NAME(slot) AS_CSTRING(vm.globalNames.values[slot])
+
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+// Write the cached registers back before calling anything that reads
+// the frame or the VM stack, and reload them after the frame changes.
+#define STORE_FRAME() \
+    do { \
+      frame->ip = ip; \
+      vm.stackTop = stackTop; \
+    } while (false)
+#define LOAD_FRAME() \
+    do { \
+      frame = &vm.frames[vm.frameCount - 1]; \
+      ip = frame->ip; \
+      constants = frame->function->chunk.constants.values; \
+      stackTop = vm.stackTop; \
+    } while (false)
+
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(__VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
 #define BINARY_OP(valueType, op) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      PUSH(valueType(a op b)); \
     } while (false)
 
-  for (;;) {
+// The compiler only emits unchecked instructions where it has proved
+// the operands are numbers.
+#define UNCHECKED_OP(valueType, op) \
+    do { \
+      double b = AS_NUMBER(POP()); \
+      PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b); \
+    } while (false)
+
+// Rewrites the instruction just read, which executes as op from now
+// on. Used by the generic instructions to quicken themselves.
+#define QUICKEN(length, op) (ip[-(length)] = (op))
+
+// Puts back the generic form of a quickened instruction whose operands
+// no longer match, and rewinds so that it runs next. Must come before
+// any operands are read.
+#define DEQUICKEN(op) (*--ip = (op))
+
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    printf("          ");
-    for (Value* slot = vm.localStack; slot < vm.localStackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->function->chunk,
-        (int)(frame->ip - frame->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+      STORE_FRAME(); \
+      traceExecution(frame); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+// Runs the frame's machine code, if it has any, up to the next
+// instruction it leaves to the interpreter. Checked when a call starts
+// and at the top of each loop. A caller isn't resumed in machine code
+// after a return: the way in and out costs more than the few
+// instructions that usually run before its next call or loop.
+#ifdef JIT
+#define ENTER_JIT() \
+    do { \
+      if (frame->function->jit != NULL) { \
+        STORE_FRAME(); \
+        jitRun(frame); \
+        ip = frame->ip; \
+        stackTop = vm.stackTop; \
+      } \
+    } while (false)
+#else
+#define ENTER_JIT() do { } while (false)
+#endif
+
+// Runs the frame's native code from a shared object built by --aot, if
+// it has any. Checked when a frame starts and when it is returned to,
+// since the native code leaves every call and return to the
+// interpreter.
+#ifdef AOT
+#define ENTER_AOT() \
+    do { \
+      if (frame->function->aot != NULL) { \
+        STORE_FRAME(); \
+        aotRun(frame); \
+        ip = frame->ip; \
+        stackTop = vm.stackTop; \
+      } \
+    } while (false)
+#else
+#define ENTER_AOT() do { } while (false)
+#endif
+
+// At the top of a loop, carries on in the function's machine code if it
+// has any, and otherwise counts towards tracing the loop.
+#ifdef JIT
+#define LOOP_BACK(backEdge) \
+    do { \
+      if (frame->function->jit != NULL) { \
+        ENTER_JIT(); \
+      } else if (--vm.hotLoops[HOT_LOOP_SLOT(ip)] == 0) { \
+        STORE_FRAME(); \
+        traceLoop(frame, backEdge); \
+        ip = frame->ip; \
+        stackTop = vm.stackTop; \
+      } \
+    } while (false)
+#else
+#define LOOP_BACK(backEdge) do { } while (false)
 #endif
-    uint8_t instruction;
+
+#ifdef DEBUG_PROFILE_PAIRS
+#define PROFILE_INSTRUCTION() profilePair(*ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+  ENTER_AOT();
+
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    [OpReturn] = &&op_OpReturn,
+    [OpConstant] = &&op_OpConstant,
+    [OpConstantLong] = &&op_OpConstantLong,
+    [OpNegate] = &&op_OpNegate,
+    [OpAdd] = &&op_OpAdd,
+    [OpSubtract] = &&op_OpSubtract,
+    [OpMultiply] = &&op_OpMultiply,
+    [OpDivide] = &&op_OpDivide,
+    [OpNil] = &&op_OpNil,
+    [OpFalse] = &&op_OpFalse,
+    [OpTrue] = &&op_OpTrue,
+    [OpNot] = &&op_OpNot,
+    [OpEq] = &&op_OpEq,
+    [OpGreater] = &&op_OpGreater,
+    [OpLess] = &&op_OpLess,
+    [OpNotEq] = &&op_OpNotEq,
+    [OpGreaterEq] = &&op_OpGreaterEq,
+    [OpLessEq] = &&op_OpLessEq,
+    [OpPrint] = &&op_OpPrint,
+    [OpDefineGlobal] = &&op_OpDefineGlobal,
+    [OpDefineGlobalLong] = &&op_OpDefineGlobalLong,
+    [OpGetGlobal] = &&op_OpGetGlobal,
+    [OpGetGlobalLong] = &&op_OpGetGlobalLong,
+    [OpSetGlobal] = &&op_OpSetGlobal,
+    [OpSetGlobalLong] = &&op_OpSetGlobalLong,
+    [OpGetLocal] = &&op_OpGetLocal,
+    [OpSetLocal] = &&op_OpSetLocal,
+    [OpPop] = &&op_OpPop,
+    [OpPopN] = &&op_OpPopN,
+    [OpJumpIfFalse] = &&op_OpJumpIfFalse,
+    [OpJumpIfFalseLong] = &&op_OpJumpIfFalseLong,
+    [OpJump] = &&op_OpJump,
+    [OpJumpLong] = &&op_OpJumpLong,
+    [OpLoop] = &&op_OpLoop,
+    [OpLoopLong] = &&op_OpLoopLong,
+    [OpCall] = &&op_OpCall,
+    [OpTailCall] = &&op_OpTailCall,
+    [OpConcatN] = &&op_OpConcatN,
+    [OpAddLocalConst] = &&op_OpAddLocalConst,
+    [OpJumpIfFalsePop] = &&op_OpJumpIfFalsePop,
+    [OpJumpIfNotLessLocalConst] = &&op_OpJumpIfNotLessLocalConst,
+    [OpJumpIfNotLessLocalLocal] = &&op_OpJumpIfNotLessLocalLocal,
+    [OpPrintPop] = &&op_OpPrintPop,
+    [OpAddNum] = &&op_OpAddNum,
+    [OpAddStr] = &&op_OpAddStr,
+    [OpEqNum] = &&op_OpEqNum,
+    [OpNotEqNum] = &&op_OpNotEqNum,
+    [OpAddLocalConstNum] = &&op_OpAddLocalConstNum,
+    [OpAddNumUnchecked] = &&op_OpAddNumUnchecked,
+    [OpSubtractUnchecked] = &&op_OpSubtractUnchecked,
+    [OpMultiplyUnchecked] = &&op_OpMultiplyUnchecked,
+    [OpDivideUnchecked] = &&op_OpDivideUnchecked,
+    [OpNegateUnchecked] = &&op_OpNegateUnchecked,
+    [OpGreaterUnchecked] = &&op_OpGreaterUnchecked,
+    [OpLessUnchecked] = &&op_OpLessUnchecked,
+    [OpGreaterEqUnchecked] = &&op_OpGreaterEqUnchecked,
+    [OpLessEqUnchecked] = &&op_OpLessEqUnchecked,
+    [OpAddLocalConstUnchecked] = &&op_OpAddLocalConstUnchecked,
+  };
+
+#define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+#define CASE(name) op_##name
+#define NEXT DISPATCH()
+
+  DISPATCH();
+#else
+#define CASE(name) case name
+#define NEXT break
+
+  for (;;) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
     switch (instruction = READ_BYTE()) {
-      case OpReturn: {
-              Value result = pop();
+#endif
+      CASE(OpReturn): {
+        Value result = POP();
         vm.frameCount--;
         if (vm.frameCount == 0) {
-          pop();
+          vm.stackTop = stackTop - 1;
           return INTERPRET_OK;
         }
 
         vm.stackTop = frame->slots;
-        push(result);
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        PUSH(result);
+        ENTER_AOT();
+        NEXT;
       }
-      case OpConstant: {
+      CASE(OpConstant): {
         Value constant = READ_CONSTANT();
-        push(constant);
-        break;
+        PUSH(constant);
+        NEXT;
       }
-      case OpNegate:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OpConstantLong): {
+        Value constant = constants[READ_LONG()];
+        PUSH(constant);
+        NEXT;
+      }
+      CASE(OpNegate):
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("Operand must be a number.");
         }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OpAdd: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        NEXT;
+      CASE(OpAdd): {
+        if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+          QUICKEN(1, OpAddStr);
+          STORE_FRAME();
           concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+          stackTop = vm.stackTop;
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+          QUICKEN(1, OpAddNum);
+          double b = AS_NUMBER(POP());
+          double a = AS_NUMBER(POP());
+          PUSH(NUMBER_VAL(a + b));
         } else {
-          runtimeError(
-              "Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
         }
-        break;
+        NEXT;
       }
-      case OpSubtract: BINARY_OP(NUMBER_VAL, -); break;
-      case OpMultiply: BINARY_OP(NUMBER_VAL, *); break;
-      case OpDivide: BINARY_OP(NUMBER_VAL, /); break;
-      case OpNil: push(NIL_VAL); break;
-      case OpTrue: push(BOOL_VAL(true)); break;
-      case OpFalse: push(BOOL_VAL(false)); break;
-      case OpNot:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OpEq: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+      CASE(OpSubtract): BINARY_OP(NUMBER_VAL, -); NEXT;
+      CASE(OpMultiply): BINARY_OP(NUMBER_VAL, *); NEXT;
+      CASE(OpDivide): BINARY_OP(NUMBER_VAL, /); NEXT;
+      CASE(OpNil): PUSH(NIL_VAL); NEXT;
+      CASE(OpTrue): PUSH(BOOL_VAL(true)); NEXT;
+      CASE(OpFalse): PUSH(BOOL_VAL(false)); NEXT;
+      CASE(OpNot):
+        PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+        NEXT;
+      CASE(OpEq): {
+        if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(1, OpEqNum);
+        // Comparing ropes flattens them, so the operands stay on the
+        // stack until the comparison is done.
+        STORE_FRAME();
+        bool equal = valuesEqual(PEEK(1), PEEK(0));
+        stackTop--;
+        PEEK(0) = BOOL_VAL(equal);
+        NEXT;
+      }
+      CASE(OpGreater): BINARY_OP(BOOL_VAL, >); NEXT;
+      CASE(OpLess): BINARY_OP(BOOL_VAL, <); NEXT;
+      CASE(OpNotEq): {
+        if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+          QUICKEN(1, OpNotEqNum);
+        }
+        STORE_FRAME();
+        bool equal = valuesEqual(PEEK(1), PEEK(0));
+        stackTop--;
+        PEEK(0) = BOOL_VAL(!equal);
+        NEXT;
+      }
+      // These are OpLess and OpGreater followed by OpNot, so a NaN
+      // operand makes them true rather than false.
+      CASE(OpGreaterEq): {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(BOOL_VAL(!(a < b)));
+        NEXT;
+      }
+      CASE(OpLessEq): {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(BOOL_VAL(!(a > b)));
+        NEXT;
       }
-      case OpGreater:  BINARY_OP(BOOL_VAL, >); break;
-      case OpLess:     BINARY_OP(BOOL_VAL, <); break;
-      case OpPrint: {
-        printValue(pop());
+      CASE(OpPrint): {
+        printValue(POP());
         printf("\n");
-        push(NIL_VAL);
-        break;
+        PUSH(NIL_VAL);
+        NEXT;
       }
-      case OpDefineGlobal: {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        break;
+      CASE(OpDefineGlobal): {
+        uint8_t slot = READ_BYTE();
+        vm.globalValues.values[slot] = PEEK(0);
+        NEXT;
       }
-      case OpGetGlobal: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OpDefineGlobalLong): {
+        uint32_t slot = READ_LONG();
+        vm.globalValues.values[slot] = PEEK(0);
+        NEXT;
+      }
+      CASE(OpGetGlobal): {
+        uint8_t slot = READ_BYTE();
+        Value value = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
         }
-        push(value);
-        break;
+        PUSH(value);
+        NEXT;
       }
-      case OpSetGlobal: {
-        ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name); 
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OpGetGlobalLong): {
+        uint32_t slot = READ_LONG();
+        Value value = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
         }
-        break;
+        PUSH(value);
+        NEXT;
       }
-      case OpGetLocal: {
+      CASE(OpSetGlobal): {
         uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+        }
+        vm.globalValues.values[slot] = PEEK(0);
+        NEXT;
+      }
+      CASE(OpSetGlobalLong): {
+        uint32_t slot = READ_LONG();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+        }
+        vm.globalValues.values[slot] = PEEK(0);
+        NEXT;
       }
-      case OpSetLocal: {
+      CASE(OpGetLocal): {
         uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
+        PUSH(frame->slots[slot]);
+        NEXT;
       }
-      case OpPop: pop(); break;
-      case OpLocalPop: localPop(); break;
-      case OpCopyValToLocal: {
-        Value v = pop();
-        push(v);
-        localPush(v);
+      CASE(OpSetLocal): {
+        uint8_t slot = READ_BYTE();
+        frame->slots[slot] = PEEK(0);
+        NEXT;
       }
-      break;
-      case OpJumpIfFalse: {
+      CASE(OpPop): stackTop--; NEXT;
+      CASE(OpPopN): stackTop -= READ_BYTE(); NEXT;
+      CASE(OpJumpIfFalse): {
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
+        if (isFalsey(PEEK(0))) ip += offset;
+        NEXT;
       }
-      case OpJump: {
+      CASE(OpJumpIfFalseLong): {
+        uint32_t offset = READ_LONG();
+        if (isFalsey(PEEK(0))) ip += offset;
+        NEXT;
+      }
+      CASE(OpJump): {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+        ip += offset;
+        NEXT;
       }
-      case OpLoop: {
+      CASE(OpJumpLong): {
+        uint32_t offset = READ_LONG();
+        ip += offset;
+        NEXT;
+      }
+      CASE(OpLoop): {
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+        ip -= offset;
+        LOOP_BACK(ip + offset - 3);
+        NEXT;
+      }
+      CASE(OpLoopLong): {
+        uint32_t offset = READ_LONG();
+        ip -= offset;
+        LOOP_BACK(ip + offset - 4);
+        NEXT;
       }
-      case OpCall: {
+      CASE(OpCall): {
         int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
+        STORE_FRAME();
+        if (!callValue(PEEK(argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        ENTER_AOT();
+        ENTER_JIT();
+        NEXT;
+      }
+      CASE(OpTailCall): {
+        int argCount = READ_BYTE();
+        STORE_FRAME();
+        if (!tailCall(argCount)) return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
+        ENTER_AOT();
+        ENTER_JIT();
+        NEXT;
+      }
+      CASE(OpConcatN): {
+        int count = READ_BYTE();
+        int numbers = 0;
+        int strings = 0;
+        for (int i = 0; i < count; i++) {
+          if (IS_NUMBER(PEEK(i))) {
+            numbers++;
+          } else if (IS_ANY_STRING(PEEK(i))) {
+            strings++;
+          }
+        }
+
+        if (numbers == count) {
+          double sum = AS_NUMBER(PEEK(count - 1));
+          for (int i = count - 2; i >= 0; i--) {
+            sum += AS_NUMBER(PEEK(i));
+          }
+          stackTop -= count - 1;
+          PEEK(0) = NUMBER_VAL(sum);
+        } else if (strings == count) {
+          STORE_FRAME();
+          concatenateN(count);
+          stackTop = vm.stackTop;
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        NEXT;
+      }
+      CASE(OpAddLocalConst): {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          QUICKEN(3, OpAddLocalConstNum);
+          PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+          PUSH(a);
+          PUSH(b);
+          STORE_FRAME();
+          concatenate();
+          stackTop = vm.stackTop;
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        NEXT;
+      }
+      CASE(OpJumpIfFalsePop): {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(PEEK(0))) {
+          ip += offset;
+        } else {
+          stackTop--;
+        }
+        NEXT;
+      }
+      CASE(OpJumpIfNotLessLocalConst): {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+        NEXT;
+      }
+      CASE(OpJumpIfNotLessLocalLocal): {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = frame->slots[READ_BYTE()];
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          RUNTIME_ERROR("Operands must be numbers.");
+        }
+        if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+        NEXT;
+      }
+      CASE(OpPrintPop):
+        printValue(POP());
+        printf("\n");
+        NEXT;
+      CASE(OpAddNum): {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          DEQUICKEN(OpAdd);
+          NEXT;
+        }
+        double b = AS_NUMBER(POP());
+        PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+        NEXT;
+      }
+      CASE(OpAddStr): {
+        if (!IS_ANY_STRING(PEEK(0)) || !IS_ANY_STRING(PEEK(1))) {
+          DEQUICKEN(OpAdd);
+          NEXT;
+        }
+        STORE_FRAME();
+        concatenate();
+        stackTop = vm.stackTop;
+        NEXT;
+      }
+      CASE(OpEqNum): {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          DEQUICKEN(OpEq);
+          NEXT;
+        }
+        double b = AS_NUMBER(POP());
+        PEEK(0) = BOOL_VAL(AS_NUMBER(PEEK(0)) == b);
+        NEXT;
       }
+      CASE(OpNotEqNum): {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          DEQUICKEN(OpNotEq);
+          NEXT;
+        }
+        double b = AS_NUMBER(POP());
+        PEEK(0) = BOOL_VAL(AS_NUMBER(PEEK(0)) != b);
+        NEXT;
+      }
+      CASE(OpAddLocalConstNum): {
+        Value a = frame->slots[ip[0]];
+        Value b = constants[ip[1]];
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          DEQUICKEN(OpAddLocalConst);
+          NEXT;
+        }
+        ip += 2;
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        NEXT;
+      }
+      CASE(OpAddNumUnchecked): UNCHECKED_OP(NUMBER_VAL, +); NEXT;
+      CASE(OpSubtractUnchecked): UNCHECKED_OP(NUMBER_VAL, -); NEXT;
+      CASE(OpMultiplyUnchecked): UNCHECKED_OP(NUMBER_VAL, *); NEXT;
+      CASE(OpDivideUnchecked): UNCHECKED_OP(NUMBER_VAL, /); NEXT;
+      CASE(OpNegateUnchecked):
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        NEXT;
+      CASE(OpGreaterUnchecked): UNCHECKED_OP(BOOL_VAL, >); NEXT;
+      CASE(OpLessUnchecked): UNCHECKED_OP(BOOL_VAL, <); NEXT;
+      CASE(OpGreaterEqUnchecked): {
+        double b = AS_NUMBER(POP());
+        PEEK(0) = BOOL_VAL(!(AS_NUMBER(PEEK(0)) < b));
+        NEXT;
+      }
+      CASE(OpLessEqUnchecked): {
+        double b = AS_NUMBER(POP());
+        PEEK(0) = BOOL_VAL(!(AS_NUMBER(PEEK(0)) > b));
+        NEXT;
+      }
+      CASE(OpAddLocalConstUnchecked): {
+        double a = AS_NUMBER(frame->slots[READ_BYTE()]);
+        double b = AS_NUMBER(READ_CONSTANT());
+        PUSH(NUMBER_VAL(a + b));
+        NEXT;
+      }
+#ifndef COMPUTED_GOTO
     }
   }
+#endif
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
-#undef READ_STRING
+#undef READ_LONG
+#undef GLOBAL_NAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef UNCHECKED_OP
+#undef QUICKEN
+#undef DEQUICKEN
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef DISPATCH
+#undef CASE
+#undef NEXT
 }
 
 InterpretResult interpret(const char* source) {
   ObjFunction* function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+  return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction* function) {
   push(OBJ_VAL(function));
   call(function, 0);
 
@@ -20,8 +20,25 @@
 #include "table.h"
 #include "object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * 256)
+// Calls nested deeper than this are a stack overflow. The frame and
+// value stacks start out small and grow as calls need them to.
+#define FRAMES_MAX 100000
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+// Room kept above a function's own maximum for the values the runtime
+// pushes to keep objects reachable while it allocates.
+#define STACK_RESERVE 8
+// A runtime error's stack trace shows this many of the innermost and
+// of the outermost calls, and counts the ones in between.
+#define TRACE_FRAMES 10
+
+#ifdef JIT
+// Hotness counters for loops, see jit.h.
+#define HOT_LOOPS 64
+#endif
+
+// Concatenations at least this long produce an ObjRope.
+#define ROPE_MIN_LENGTH 64
 
 typedef struct {
   ObjFunction* function;
@@ -30,17 +47,40 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
-  Value stack[STACK_MAX];
+  int frameCapacity;
 
-  Value localStack[STACK_MAX];
+  Value* stack;
+  int stackCapacity;
   Value* stackTop;
-  Value* localStackTop;
+  // Globals are resolved to slots in globalValues at compile time.
+  // globals maps each name to its slot and globalNames maps a slot
+  // back to its name for error reporting.
   Table globals;
-  Table strings;
+  ValueArray globalValues;
+  ValueArray globalNames;
+  StringSet strings;
+#ifdef JIT
+  uint16_t hotLoops[HOT_LOOPS];
+#endif
 
+  size_t bytesAllocated;
+  size_t nextGC;
   Obj* objects;
+  bool inMajorGC;
+
+  uint8_t* nursery;
+  uint8_t* nurseryTop;
+  uint8_t* nurseryEnd;
+  bool inMinorGC;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+  int grayCount;
+  int grayCapacity;
+  Obj** grayStack;
 } VM;
 
 typedef enum {
@@ -54,10 +94,15 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+// Runs a script that is already compiled.
+InterpretResult interpretFunction(ObjFunction* function);
 void push(Value value);
 Value pop();
-Value localPop();
-void localPush(Value value);
+
+// Replace the top two, or the top count, values on the stack, which
+// must all be strings or ropes, with their concatenation.
+void concatenate();
+void concatenateN(int count);
 
 #endif
 